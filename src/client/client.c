@@ -539,6 +539,11 @@ static int client_request (struct client *client, struct client_request *request
         }
 
         log_info("%s", "");
+
+        if ((err = http_flush(client->http))) {
+            log_error("error sending request");
+            return -1;
+        }
     }
 
     // response
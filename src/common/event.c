@@ -1,136 +1,244 @@
 #include "event.h"
+#include "common/event_internal.h"
 
 #include "common/log.h"
 #include "common/util.h"
 
-#include <pcl.h>
-
-#include <assert.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <sys/queue.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifdef VALGRIND
 #include <valgrind/valgrind.h>
 #endif // VALGRIND
 
-struct event_main {
-    // currently executing task, maintained by event_switch()
-    // NULL when in main() -> event_main()
-    struct event_task *task;
-
-    /*
-     * The set of existing events, which event_main() will operate.
-     *
-     * event_main() will exit once there are no more events left, or none of the
-     * events have any tasks associated.
-     */
-    TAILQ_HEAD(event_main_events, event) events;
+/*
+ * Supported backends, in order of preference.
+ */
+static const struct event_backend *event_backends[] = {
+#if !defined(EVENT_SELECT) && !defined(EVENT_EPOLL)
+    &event_uring_backend,
+#endif
+#ifndef EVENT_SELECT
+    &event_epoll_backend,
+#endif
+    &event_select_backend,
+    NULL
 };
 
-struct event {
+int event_main_create (struct event_main **event_mainp)
+{
+    const struct event_backend **backendp;
     struct event_main *event_main;
-    
-    // fixed state
-    int fd;
-
-    /*
-     * The flags will be set to nonzero by event_yield() once some task is pending on this event.
-     *
-     * The flags will be zero when there is no task pending on this event.
-     */
-    int flags;
+    int err;
 
-    /*
-     * Absolute timeout value for this task, valid when flags & EVENT_TIMEOUT.
-     */
-    struct timeval timeout;
-
-    /*
-     * The task that has yielded on this event.
-     * Only one task may be yielding on an event at any time!
-     *
-     * event_main() will then switch into this task.
-     */
-    struct event_task *task;
+    if (!(event_main = calloc(1, sizeof(*event_main)))) {
+        log_perror("calloc");
+        return -1;
+    }
 
-    /*
-     * Delayed event_destroy() while within event_main()
-     */
-    bool destroy;
+    TAILQ_INIT(&event_main->events);
+    TAILQ_INIT(&event_main->destroys);
+    TAILQ_INIT(&event_main->waits);
+    TAILQ_INIT(&event_main->runq);
+    TAILQ_INIT(&event_main->spawns);
+    TAILQ_INIT(&event_main->stacks);
+    TAILQ_INIT(&event_main->task_names);
+
+    event_main->stack_size = EVENT_TASK_SIZE;
+    event_main->slow_task = EVENT_TASK_SLOW;
+    event_main->spawn_max = EVENT_SPAWN_MAX;
+    event_main->buf_size = EVENT_BUF_SIZE;
+
+    for (backendp = event_backends; *backendp; backendp++) {
+        if ((err = (*backendp)->create(event_main)) < 0) {
+            log_error("%s", (*backendp)->name);
+            goto error;
+        }
 
-    TAILQ_ENTRY(event) event_main_events;
-};
+        if (err) {
+            log_warning("%s: not supported, falling back", (*backendp)->name);
+            continue;
+        }
 
-struct event_task {
-    struct event_main *event_main;
+        event_main->backend = *backendp;
 
-    // debug info
-    const char *name;
+        break;
+    }
 
-    // event_start() execution info
-    event_task_func *func;
-    void *ctx;
+    if (!event_main->backend) {
+        log_error("no supported event backend");
+        goto error;
+    }
 
-    /*
-     * This task has event_register()'d for the given number of events.
-     */
-    int registered;
+    log_info("%s", event_main->backend->name);
 
-    /*
-     * This task is event_wait()'ing on some given event.
-     */
-    struct event *wait;
+    // for any timeouts set before event_main_run()
+    if (timestamp_now(&event_main->now)) {
+        log_error("timestamp_now");
+        goto error;
+    }
 
-    /*
-     * This task was woken up for the given event.
-     */
-    struct event *event;
+    if (event_post_init(event_main)) {
+        log_error("event_post_init");
+        goto error;
+    }
 
-    /*
-     * Set within the task once func() returns.
-     *
-     * Used by event_switch() to clean up the task once it has returned.
-     */
-    bool exit;
+    *event_mainp = event_main;
+    return 0;
 
-    // low-level libpcl state
-    coroutine_t co;
-    void *co_stack;
+error:
+    free(event_main);
+    return -1;
+}
 
-#ifdef VALGRIND
-    int co_valgrind;
-#endif
-};
+int event_thread_init (void)
+{
+    if (event_context_thread_init()) {
+        log_error("event_context_thread_init");
+        return -1;
+    }
 
-int event_main_create (struct event_main **event_mainp)
+    return 0;
+}
+
+void event_thread_cleanup (void)
 {
-    struct event_main *event_main;
+    event_context_thread_cleanup();
+}
 
-    if (!(event_main = calloc(1, sizeof(*event_main)))) {
-        log_perror("calloc");
-        return -1;
+int event_get_max (struct event_main *event_main)
+{
+    return event_main->backend->max(event_main);
+}
+
+/*
+ * Initial size of the timer heap, grown as needed.
+ */
+#define EVENT_TIMERS_SIZE 64
+
+static inline bool event_timer_before (const struct event_timer *a, const struct event_timer *b)
+{
+    return timercmp(&a->timeout, &b->timeout, <);
+}
+
+static inline void event_timer_place (struct event_main *event_main, struct event_timer *timer, unsigned index)
+{
+    event_main->timers[index] = timer;
+    timer->index = index;
+}
+
+/*
+ * Move the timer at the given heap index up towards the root, until its parent is not after it.
+ */
+static void event_timer_up (struct event_main *event_main, unsigned index)
+{
+    struct event_timer *timer = event_main->timers[index];
+
+    while (index > 1 && event_timer_before(timer, event_main->timers[index / 2])) {
+        event_timer_place(event_main, event_main->timers[index / 2], index);
+
+        index /= 2;
     }
 
-    TAILQ_INIT(&event_main->events);
+    event_timer_place(event_main, timer, index);
+}
+
+/*
+ * Move the timer at the given heap index down towards the leaves, until neither of its children are before it.
+ */
+static void event_timer_down (struct event_main *event_main, unsigned index)
+{
+    struct event_timer *timer = event_main->timers[index];
+    unsigned child;
+
+    while ((child = index * 2) <= event_main->timers_count) {
+        if (child < event_main->timers_count && event_timer_before(event_main->timers[child + 1], event_main->timers[child]))
+            child++;
+
+        if (!event_timer_before(event_main->timers[child], timer))
+            break;
+
+        event_timer_place(event_main, event_main->timers[child], index);
+
+        index = child;
+    }
+
+    event_timer_place(event_main, timer, index);
+}
+
+int event_timer_arm (struct event_main *event_main, struct event_timer *timer)
+{
+    if (timer->index) {
+        // re-arm in place
+        event_timer_up(event_main, timer->index);
+        event_timer_down(event_main, timer->index);
+
+        return 0;
+    }
+
+    if (event_main->timers_count + 1 >= event_main->timers_size) {
+        unsigned size = event_main->timers_size ? event_main->timers_size * 2 : EVENT_TIMERS_SIZE;
+        struct event_timer **timers;
+
+        if (!(timers = realloc(event_main->timers, size * sizeof(*timers)))) {
+            log_perror("realloc %u", size);
+            return -1;
+        }
+
+        event_main->timers = timers;
+        event_main->timers_size = size;
+    }
+
+    event_main->timers[++event_main->timers_count] = timer;
+    event_timer_up(event_main, event_main->timers_count);
 
-    *event_mainp = event_main;
     return 0;
 }
 
-int event_get_max (struct event_main *event_main)
+void event_timer_disarm (struct event_main *event_main, struct event_timer *timer)
 {
-    // TODO: switch to something better than select()
-    return FD_SETSIZE;
+    unsigned index = timer->index;
+    struct event_timer *last;
+
+    if (!index)
+        return;
+
+    timer->index = 0;
+    last = event_main->timers[event_main->timers_count--];
+
+    if (last == timer)
+        return;
+
+    // fill the hole with the last timer, which may need to move either way
+    event_timer_place(event_main, last, index);
+    event_timer_up(event_main, index);
+    event_timer_down(event_main, last->index);
+}
+
+/*
+ * Timer for an event_yield() with a timeout.
+ */
+static void event_timeout (struct event_main *event_main, struct event_timer *timer)
+{
+    struct event *event = timer->ctx;
+
+    // this may event_destroy(event)
+    event_dispatch(event_main, event, EVENT_TIMEOUT);
 }
 
 int event_create (struct event_main *event_main, struct event **eventp, int fd)
 {
     struct event *event;
+    int max = event_get_max(event_main);
 
-    // TODO: switch to something better than select()
-    if (fd >= event_get_max(event_main)) {
-        log_error("given fd is too large: %d > %d", fd, event_get_max(event_main));
+    if (max && fd >= max) {
+        log_error("given fd is too large: %d > %d", fd, max);
         return -1;
     }
 
@@ -141,6 +249,16 @@ int event_create (struct event_main *event_main, struct event **eventp, int fd)
     
     event->event_main = event_main;
     event->fd = fd;
+    event->timer.func = event_timeout;
+    event->timer.ctx = event;
+
+    TAILQ_INIT(&event->waits);
+
+    if (event_main->backend->add(event_main, event)) {
+        log_error("%s add %d", event_main->backend->name, fd);
+        free(event);
+        return -1;
+    }
 
     // ok
     TAILQ_INSERT_TAIL(&event_main->events, event, event_main_events);
@@ -150,17 +268,209 @@ int event_create (struct event_main *event_main, struct event **eventp, int fd)
     return 0;
 }
 
+/*
+ * Map a new stack for use by a task, with a guard page below it to catch overflows.
+ */
+static int event_stack_map (struct event_main *event_main, struct event_stack **stackp)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t map_size = page_size + event_main->stack_size;
+    struct event_stack *stack;
+    void *map;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#ifdef MAP_STACK
+    flags |= MAP_STACK;
+#endif
+
+    if ((map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, flags, -1, 0)) == MAP_FAILED) {
+        log_perror("mmap %zu", map_size);
+        return -1;
+    }
+
+    if (mprotect(map, page_size, PROT_NONE)) {
+        log_perror("mprotect %p", map);
+        munmap(map, map_size);
+        return -1;
+    }
+
+    // the struct goes at the top, as the stack grows down towards the guard page
+    stack = (struct event_stack *) ((char *) map + map_size - sizeof(*stack));
+
+    stack->map = map;
+    stack->map_size = map_size;
+    stack->base = (char *) map + page_size;
+    stack->size = ((char *) stack - (char *) stack->base) & ~(size_t) 15;
+
+#ifdef VALGRIND
+    stack->valgrind = VALGRIND_STACK_REGISTER(stack->base, stack->base + stack->size);
+    log_info("VALGRIND_STACK_REGISTER(%p, %p) = %d",
+            stack->base,
+            stack->base + stack->size,
+            stack->valgrind
+    );
+#endif
+
+    log_debug("%p: %zu", stack->base, stack->size);
+
+    *stackp = stack;
+
+    return 0;
+}
+
+static void event_stack_unmap (struct event_stack *stack)
+{
+    log_debug("%p: %zu", stack->base, stack->size);
+
+#ifdef VALGRIND
+    VALGRIND_STACK_DEREGISTER(stack->valgrind);
+#endif
+
+    if (munmap(stack->map, stack->map_size))
+        log_pwarning("munmap %p", stack->map);
+}
+
+/*
+ * Get a stack for a new task, re-using a pooled stack if available.
+ */
+static int event_stack_get (struct event_main *event_main, struct event_stack **stackp)
+{
+    struct event_stack *stack;
+
+    if ((stack = TAILQ_FIRST(&event_main->stacks))) {
+        TAILQ_REMOVE(&event_main->stacks, stack, event_main_stacks);
+        event_main->stacks_count--;
+
+        *stackp = stack;
+
+        return 0;
+    }
+
+    return event_stack_map(event_main, stackp);
+}
+
+/*
+ * Return the stack of an exited task to the pool, or release it if the pool is full.
+ *
+ * The pages dirtied by the task are discarded, keeping only the top page with the struct, such that pooled stacks
+ * only hold on to their mappings, and not their memory.
+ */
+static void event_stack_put (struct event_main *event_main, struct event_stack *stack)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    if (event_main->stacks_count >= EVENT_STACK_POOL || stack->map_size != page_size + event_main->stack_size) {
+        event_stack_unmap(stack);
+
+    } else {
+        char *top = (char *) ((uintptr_t) stack & ~(uintptr_t) (page_size - 1));
+
+        if (top > (char *) stack->base && madvise(stack->base, top - (char *) stack->base, MADV_DONTNEED))
+            log_pwarning("madvise %p", stack->base);
+
+        // most recently used first, as it is the most likely to still be cached
+        TAILQ_INSERT_HEAD(&event_main->stacks, stack, event_main_stacks);
+        event_main->stacks_count++;
+    }
+}
+
+int event_main_set_stack_size (struct event_main *event_main, size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    struct event_stack *stack;
+
+    if (size < page_size) {
+        log_error("stack size is too small: %zu < %zu", size, page_size);
+        return -1;
+    }
+
+    event_main->stack_size = (size + page_size - 1) & ~(page_size - 1);
+
+    // release pooled stacks of the wrong size
+    while ((stack = TAILQ_FIRST(&event_main->stacks))) {
+        TAILQ_REMOVE(&event_main->stacks, stack, event_main_stacks);
+        event_main->stacks_count--;
+
+        event_stack_unmap(stack);
+    }
+
+    return 0;
+}
+
+void event_main_set_slow_task (struct event_main *event_main, unsigned long usec)
+{
+    event_main->slow_task = usec;
+}
+
+/*
+ * Lookup the shared stats for tasks of the given name, creating them on first use.
+ */
+static struct event_task_stats *event_task_stats (struct event_main *event_main, const char *name)
+{
+    struct event_task_name *task_name;
+
+    TAILQ_FOREACH(task_name, &event_main->task_names, event_main_task_names) {
+        if (task_name->stats.name == name || !strcmp(task_name->stats.name, name))
+            return &task_name->stats;
+    }
+
+    if (!(task_name = calloc(1, sizeof(*task_name)))) {
+        log_perror("calloc");
+        return NULL;
+    }
+
+    task_name->stats.name = name;
+
+    TAILQ_INSERT_TAIL(&event_main->task_names, task_name, event_main_task_names);
+
+    return &task_name->stats;
+}
+
+/*
+ * Charge the time since the last switch to the given task, which has been running since then.
+ */
+static void event_task_charge (struct event_main *event_main, struct event_task *task)
+{
+    struct timespec now;
+    unsigned long elapsed;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+        log_pwarning("clock_gettime");
+        return;
+    }
+
+    elapsed = (now.tv_sec - event_main->switch_time.tv_sec) * 1000000L + (now.tv_nsec - event_main->switch_time.tv_nsec) / 1000;
+
+    event_main->switch_time = now;
+
+    if (!task || !task->stats)
+        return;
+
+    task->stats->slices++;
+    task->stats->time += elapsed;
+
+    if (elapsed > task->stats->max)
+        task->stats->max = elapsed;
+
+    if (event_main->slow_task && elapsed > event_main->slow_task) {
+        log_warning("%s[%p] ran for %luus without yielding", task->name, task, elapsed);
+
+        task->stats->slow++;
+        event_main->stats.slow_slices++;
+    }
+}
+
 /*
  * This function is responsible for going further down into the task stack, and maintaining the
  * event_main->task state.
  *
- * No other function may use co_call(), and no task may event_switch() into a task that it has been
+ * No other function may use event_context_call(), and no task may event_switch() into a task that it has been
  * event_switch()'d into from.
  *
  * This function is also resposible for cleaning up after tasks that have exited, and will set *taskp
  * to NULL if that happens.
  */
-static void event_switch (struct event_main *event_main, struct event_task **taskp)
+void event_switch (struct event_main *event_main, struct event_task **taskp)
 {
     struct event_task *task = *taskp;
     struct event_task *main_task = event_main->task;
@@ -168,9 +478,16 @@ static void event_switch (struct event_main *event_main, struct event_task **tas
 
     log_debug("%s[%p] -> %s[%p]", main_name, main_task, task->name, task);
 
+    // the main task runs the loop, which is covered by the iteration stats
+    event_task_charge(event_main, main_task);
+
     event_main->task = task;
+    event_main->stats.switches++;
+
+    event_context_call(&task->context);
 
-    co_call(task->co);
+    // any tasks that this task switched into have already been charged for their own time
+    event_task_charge(event_main, task);
 
     if (task->exit) {
         log_debug("%s[%p] <- %s[%p]: exit %d", main_name, main_task, task->name, task, task->exit);
@@ -178,7 +495,10 @@ static void event_switch (struct event_main *event_main, struct event_task **tas
         // notify caller as well - we might also be deleting ourself!?
         *taskp = NULL;
 
-        free(task->co_stack);
+        event_main->stats.tasks--;
+        event_main->stats.stack_bytes -= task->stack->size;
+
+        event_stack_put(event_main, task->stack);
         free(task);
 
     } else {
@@ -202,44 +522,53 @@ static void event_task (void *ctx)
 
     log_debug("%s[%p] exit", task->name, task);
 
-    // XXX: implicit co_resume()?
+    // returns back into event_switch()
 }
 
-int _event_start (struct event_main *event_main, const char *name, event_task_func *func, void *ctx)
+/*
+ * Allocate a new task, without any stack yet.
+ */
+static struct event_task *event_task_create (struct event_main *event_main, const char *name, event_task_func *func, void *ctx)
 {
     struct event_task *task;
 
     if (!(task = calloc(1, sizeof(*task)))) {
         log_perror("calloc");
-        return -1;
+        return NULL;
     }
 
     task->name = name;
-
-    if (!(task->co_stack = malloc(EVENT_TASK_SIZE))) {
-        log_perror("malloc co_stack");
-        goto error;
-    }
-
     task->func = func;
     task->ctx = ctx;
 
-    if (!(task->co = co_create(event_task, task, task->co_stack, EVENT_TASK_SIZE))) {
-        log_perror("co_create");
+    if ((task->stats = event_task_stats(event_main, name)))
+        task->stats->tasks++;
+
+    return task;
+}
+
+/*
+ * Set up the stack for a new task, and switch into it until it first yields or exits.
+ *
+ * The task is released on errors.
+ */
+static int event_task_boot (struct event_main *event_main, struct event_task *task)
+{
+    if (event_stack_get(event_main, &task->stack)) {
+        log_error("event_stack_get");
         goto error;
     }
 
-#ifdef VALGRIND
-    task->co_valgrind = VALGRIND_STACK_REGISTER(task->co_stack, task->co_stack + EVENT_TASK_SIZE);
-    log_info("VALGRIND_STACK_REGISTER(%p, %p) = %d",
-            task->co_stack, 
-            task->co_stack + EVENT_TASK_SIZE,
-            task->co_valgrind
-    );
-#endif
+    if (event_context_create(&task->context, event_task, task, task->stack->base, task->stack->size)) {
+        log_error("event_context_create");
+        goto error;
+    }
 
     log_debug("-> %s[%p]", task->name, task);
 
+    event_main->stats.tasks++;
+    event_main->stats.stack_bytes += task->stack->size;
+
     event_switch(event_main, &task);
     
     log_debug("<- %s[%p]",
@@ -249,12 +578,135 @@ int _event_start (struct event_main *event_main, const char *name, event_task_fu
     return 0;
 
 error:
-    free(task->co_stack);
+    if (task->stack)
+        event_stack_put(event_main, task->stack);
+
     free(task);
 
     return -1;
 }
 
+int _event_start (struct event_main *event_main, const char *name, event_task_func *func, void *ctx)
+{
+    struct event_task *task;
+
+    if (!(task = event_task_create(event_main, name, func, ctx)))
+        return -1;
+
+    return event_task_boot(event_main, task);
+}
+
+int _event_spawn (struct event_main *event_main, const char *name, event_task_func *func, void *ctx)
+{
+    struct event_task *task;
+
+    if (!(task = event_task_create(event_main, name, func, ctx)))
+        return -1;
+
+    log_debug("%s[%p]", task->name, task);
+
+    TAILQ_INSERT_TAIL(&event_main->spawns, task, event_main_runq);
+    event_main->spawns_count++;
+    event_main->pending++;
+
+    return 0;
+}
+
+void event_main_set_spawn_max (struct event_main *event_main, unsigned max)
+{
+    event_main->spawn_max = max;
+}
+
+/*
+ * Return the size class for the given power-of-two buffer size, or -1 if not pooled.
+ */
+static int event_buf_class (struct event_main *event_main, size_t size)
+{
+    int class = 0;
+
+    if (size < sizeof(struct event_buf) || size > event_main->buf_size || (size & (size - 1)))
+        return -1;
+
+    while (size >>= 1)
+        class++;
+
+    return class;
+}
+
+int event_main_set_buf_size (struct event_main *event_main, size_t size)
+{
+    size_t buf_size = sizeof(struct event_buf);
+
+    while (buf_size < size && buf_size < (size_t) 1 << (EVENT_BUF_CLASSES - 1))
+        buf_size <<= 1;
+
+    if (buf_size < size) {
+        log_error("buffer size is too large: %zu", size);
+        return -1;
+    }
+
+    event_main->buf_size = buf_size;
+
+    return 0;
+}
+
+size_t event_main_buf_size (struct event_main *event_main)
+{
+    return event_main->buf_size;
+}
+
+void * event_main_buf_get (struct event_main *event_main, size_t size)
+{
+    int class = event_buf_class(event_main, size);
+    struct event_buf *buf;
+
+    if (class < 0 || !(buf = event_main->bufs[class]))
+        return NULL;
+
+    event_main->bufs[class] = buf->next;
+    event_main->bufs_count[class]--;
+    event_main->stats.buf_bytes_pooled -= size;
+
+    return buf;
+}
+
+int event_main_buf_put (struct event_main *event_main, void *ptr, size_t size)
+{
+    int class = event_buf_class(event_main, size);
+    struct event_buf *buf = ptr;
+
+    if (class < 0 || event_main->bufs_count[class] >= EVENT_BUF_POOL)
+        return 1;
+
+    // most recently used first, as it is the most likely to still be cached
+    buf->next = event_main->bufs[class];
+    event_main->bufs[class] = buf;
+    event_main->bufs_count[class]++;
+    event_main->stats.buf_bytes_pooled += size;
+
+    return 0;
+}
+
+void event_main_timestamp (struct event_main *event_main, struct timeval *timestamp, const struct timeval *timeout)
+{
+    // normalizing tv_usec
+    timeradd(&event_main->now, timeout, timestamp);
+}
+
+int event_main_timeout (struct event_main *event_main, struct timeval *timeout, const struct timeval *timestamp)
+{
+    if (timercmp(timestamp, &event_main->now, <)) {
+        timeout->tv_sec = 0;
+        timeout->tv_usec = 0;
+
+        return 1;
+    }
+
+    timersub(timestamp, &event_main->now, timeout);
+
+    return 0;
+}
+
 int event_pending (struct event *event)
 {
     if (event->task)
@@ -282,30 +734,36 @@ int event_register (struct event *event, int flags, const struct timeval *timeou
         return -1;
     }
     
-    event->task = task;
-    event->flags = flags;
+    if (event->event_main->backend->mod && event->event_main->backend->mod(event->event_main, event, flags & (EVENT_READ | EVENT_WRITE))) {
+        log_error("%s mod %d", event->event_main->backend->name, event->fd);
+        return -1;
+    }
 
     if (timeout) {
-        event->flags |= EVENT_TIMEOUT;
+        flags |= EVENT_TIMEOUT;
 
         // set timeout in future
-        if (timestamp_from_timeout(&event->timeout, timeout)) {
-            log_error("timestamp_from_timeout");
-            return -1;
-        }
+        event_main_timestamp(event->event_main, &event->timer.timeout, timeout);
         
-    } else if (event->flags & EVENT_TIMEOUT) {
+    } else if (flags & EVENT_TIMEOUT) {
         // set immediate timeout
-        if (timestamp_now(&event->timeout)) {
-            log_error("timestamp_now");
-            return -1;
-        }
+        event->timer.timeout = event->event_main->now;
+    }
+
+    if ((flags & EVENT_TIMEOUT) && event_timer_arm(event->event_main, &event->timer)) {
+        log_error("event_timer_arm");
+        return -1;
     }
 
-    log_debug("%s[%p] %d(%s%s%s)", task->name, task, event->fd,
+    event->task = task;
+    event->flags = flags;
+    event->event_main->pending++;
+
+    log_debug("%s[%p] %d(%s%s%s%s)", task->name, task, event->fd,
             event->flags & EVENT_READ ? "R" : "",
             event->flags & EVENT_WRITE ? "W" : "",
-            event->flags & EVENT_TIMEOUT ? "T" : ""
+            event->flags & EVENT_TIMEOUT ? "T" : "",
+            event->flags & EVENT_IO ? "I" : ""
     );
 
     // mark
@@ -314,6 +772,22 @@ int event_register (struct event *event, int flags, const struct timeval *timeou
     return 0;
 }
 
+/*
+ * Clear the yield state for an event, once the task pending on it has woken up.
+ *
+ * The registered backend interest is left as-is, and only updated on the next event_register().
+ */
+static void event_clear (struct event *event)
+{
+    if (event->task)
+        event->event_main->pending--;
+
+    event_timer_disarm(event->event_main, &event->timer);
+
+    event->flags = 0;
+    event->task = NULL;
+}
+
 /*
  * Internal wait-for-event_switch()-from-event_main() mechaism.
  *
@@ -335,14 +809,15 @@ static int _event_yield (struct event_main *event_main, struct event **eventp)
 
     log_debug("<- %s[%p]", task->name, task);
 
-    co_resume();
+    event_context_resume(&task->context);
 
     struct event *event = task->event;
 
-    log_debug("-> %s[%p] %d(%s%s%s)", task->name, task, event->fd,
+    log_debug("-> %s[%p] %d(%s%s%s%s)", task->name, task, event->fd,
             event->flags & EVENT_READ ? "R" : "",
             event->flags & EVENT_WRITE ? "W" : "",
-            event->flags & EVENT_TIMEOUT ? "T" : ""
+            event->flags & EVENT_TIMEOUT ? "T" : "",
+            event->flags & EVENT_IO ? "I" : ""
     );
     
     // XXX: this might underflow in some really weird circumstances
@@ -377,8 +852,7 @@ int event_main_yield (struct event_main *event_main, struct event **eventp)
     int flags = event->flags;
     
     // clear yield state
-    event->flags = 0;
-    event->task = NULL;
+    event_clear(event);
     
     // ok
     *eventp = event;
@@ -398,8 +872,7 @@ int event_yield (struct event *event, int flags, const struct timeval *timeout)
     flags = event->flags;
     
     // clear yield state
-    event->flags = 0;
-    event->task = NULL;
+    event_clear(event);
 
     if (flags & EVENT_TIMEOUT)
         return 1;
@@ -407,6 +880,104 @@ int event_yield (struct event *event, int flags, const struct timeval *timeout)
         return 0;
 }
 
+int event_io_supported (struct event *event)
+{
+    return event->event_main->backend->io != NULL;
+}
+
+/*
+ * Yield until the submitted event_io() operation has completed.
+ *
+ * Returns 0 on completion, 1 on timeout, <0 on error.
+ */
+static int event_io_yield (struct event *event)
+{
+    int flags;
+
+    if (_event_yield(event->event_main, &event))
+        return -1;
+
+    // read event state
+    flags = event->flags;
+
+    // clear yield state
+    event_clear(event);
+
+    if (flags & EVENT_IO)
+        return 0;
+    else
+        return 1;
+}
+
+int event_io (struct event *event, enum event_io_op op, void *buf, size_t size, const struct timeval *timeout, int *resp)
+{
+    struct event_main *event_main = event->event_main;
+    const struct event_backend *backend = event_main->backend;
+    int err;
+
+    if (!backend->io) {
+        log_fatal("%s does not support event_io()", backend->name);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    while (true) {
+        if (event_register(event, EVENT_IO, timeout))
+            return -1;
+
+        if (backend->io(event_main, event, op, buf, size)) {
+            log_error("%s io %d", backend->name, event->fd);
+
+            event_main->task->registered--;
+            event_clear(event);
+
+            return -1;
+        }
+
+        if ((err = event_io_yield(event)) < 0) {
+            return err;
+
+        } else if (err) {
+            // the operation still refers to the buf, so it must complete before we return
+            if (backend->cancel(event_main, event)) {
+                log_fatal("%s cancel %d", backend->name, event->fd);
+                return -1;
+            }
+
+            if (event_register(event, EVENT_IO, NULL))
+                return -1;
+
+            if (event_io_yield(event)) {
+                log_error("event_io_yield");
+                return -1;
+            }
+
+            if (event->io_res == -ECANCELED) {
+                log_debug("%d: timeout", event->fd);
+                return 1;
+            }
+        }
+
+        if (event->io_res != -EAGAIN)
+            break;
+
+        // the backend was not able to wait for the operation, so wait for readiness and retry
+        log_debug("%d: retry", event->fd);
+
+        if ((err = event_yield(event, (op == EVENT_IO_WRITE || op == EVENT_IO_WRITEV) ? EVENT_WRITE : EVENT_READ, timeout)))
+            return err;
+    }
+
+    if (event->io_res < 0) {
+        errno = -event->io_res;
+        return -1;
+    }
+
+    *resp = event->io_res;
+
+    return 0;
+}
+
 int event_sleep (struct event *event, const struct timeval *timeout)
 {
     if (event_register(event, EVENT_TIMEOUT, timeout))
@@ -420,8 +991,7 @@ int event_sleep (struct event *event, const struct timeval *timeout)
     int flags = event->flags;
 
     // clear yield state
-    event->flags = 0;
-    event->task = NULL;
+    event_clear(event);
 
     if (flags != EVENT_TIMEOUT) {
         struct event_task *task = event->event_main->task;
@@ -432,9 +1002,78 @@ int event_sleep (struct event *event, const struct timeval *timeout)
     return 0;
 }
 
-int event_wait (struct event *event, struct event_task **waitp)
+int event_yield_now (struct event_main *event_main)
 {
-    struct event_task *task = event->event_main->task;
+    struct event_task *task = event_main->task;
+
+    if (!task) {
+        log_fatal("yielding without task; main() should be in event_main() now...");
+        return -1;
+    }
+
+    event_schedule(event_main, task);
+
+    log_debug("<- %s[%p]", task->name, task);
+
+    event_context_resume(&task->context);
+
+    log_debug("-> %s[%p]", task->name, task);
+
+    return 0;
+}
+
+/*
+ * Wake up the given task from event_wait(), returning the given result.
+ *
+ * Used from event_main() for waiting tasks that will never be event_notify()'d.
+ */
+static void event_wait_wake (struct event_main *event_main, struct event_task *task, int res)
+{
+    log_debug("%s[%p] %d", task->name, task, res);
+
+    // no longer available for event_notify()
+    *task->waitp = NULL;
+    task->wait_res = res;
+
+    event_switch(event_main, &task);
+}
+
+/*
+ * Timer for an event_wait() with a timeout.
+ */
+static void event_wait_timeout (struct event_main *event_main, struct event_timer *timer)
+{
+    event_wait_wake(event_main, timer->ctx, 1);
+}
+
+/*
+ * Wake up any tasks waiting on events that nobody is yielding on, and thus will never be event_notify()'d.
+ *
+ * Waiters are woken one at a time, as the first one may take over yielding on the event.
+ */
+static void event_main_orphans (struct event_main *event_main)
+{
+    struct event *event, *next;
+    struct event_task *task;
+
+    for (event = TAILQ_FIRST(&event_main->waits); event; event = next) {
+        // the event may be removed once all of its waiters are gone
+        next = TAILQ_NEXT(event, event_main_waits);
+
+        while (!event->task && (task = TAILQ_FIRST(&event->waits))) {
+            log_warning("%s[%p] orphaned waiting on %d[%p]", task->name, task, event->fd, event);
+
+            // removes the task from event->waits
+            event_wait_wake(event_main, task, -EPIPE);
+        }
+    }
+}
+
+int event_wait (struct event *event, struct event_task **waitp, const struct timeval *timeout)
+{
+    struct event_main *event_main = event->event_main;
+    struct event_task *task = event_main->task;
+    int res;
 
     if (!task) {
         log_fatal("the main task is attempt to wait on event:%d; main() should be in event_main() now...", event->fd);
@@ -451,12 +1090,38 @@ int event_wait (struct event *event, struct event_task **waitp)
         return -1;
     }
 
+    if (timeout) {
+        task->wait_timer.func = event_wait_timeout;
+        task->wait_timer.ctx = task;
+
+        event_main_timestamp(event_main, &task->wait_timer.timeout, timeout);
+
+        if (event_timer_arm(event_main, &task->wait_timer)) {
+            log_error("event_timer_arm");
+            return -1;
+        }
+    }
+
     *waitp = task;
     task->wait = event;
+    task->waitp = waitp;
+    task->wait_res = 0;
+
+    if (TAILQ_EMPTY(&event->waits))
+        TAILQ_INSERT_TAIL(&event_main->waits, event, event_main_waits);
+
+    TAILQ_INSERT_TAIL(&event->waits, task, event_waits);
 
     log_debug("<- %s[%p]", task->name, task);
 
-    co_resume();
+    event_context_resume(&task->context);
+
+    TAILQ_REMOVE(&event->waits, task, event_waits);
+
+    if (TAILQ_EMPTY(&event->waits))
+        TAILQ_REMOVE(&event_main->waits, event, event_main_waits);
+
+    event_timer_disarm(event_main, &task->wait_timer);
 
     if (*waitp) {
         log_warning("%s[%p] woke up from wait with still the notify-pointer still set to %p!", task->name, task, *waitp);
@@ -467,10 +1132,17 @@ int event_wait (struct event *event, struct event_task **waitp)
     }
 
     task->wait = NULL;
+    task->waitp = NULL;
+    res = task->wait_res;
 
-    log_debug("-> %s[%p]", task->name, task);
+    log_debug("-> %s[%p] %d", task->name, task, res);
 
-    return 0;
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+
+    return res;
 }
 
 int event_notify (struct event *event, struct event_task **notifyp)
@@ -508,6 +1180,8 @@ int event_notify (struct event *event, struct event_task **notifyp)
 
 void event_destroy (struct event *event)
 {
+    struct event_main *event_main = event->event_main;
+
     if (event->task && event->task->registered) {
         log_debug("%d[%p] unregistering from task %s[%p]",
                 event->fd, event,
@@ -522,156 +1196,287 @@ void event_destroy (struct event *event)
         );
     }
 
-    event->task = NULL;
+    event_clear(event);
+
+    if (event->destroy) {
+        log_warning("%d[%p] already destroyed", event->fd, event);
+        return;
+    }
 
-    if (event->event_main->task) {
-        log_debug("%d[%p] delaying destroy() from task %s[%p]",
+    // the fd will be closed once we return
+    event_main->backend->del(event_main, event);
+
+    if (event_main->task || event->backend_refs || !TAILQ_EMPTY(&event->waits)) {
+        log_debug("%d[%p] delaying destroy() from task %s[%p] with %u backend refs",
                 event->fd, event,
-                event->event_main->task->name, event->event_main->task
+                event_main->task ? event_main->task->name : "*", event_main->task,
+                event->backend_refs
         );
 
         event->destroy = true;
 
+        TAILQ_INSERT_TAIL(&event_main->destroys, event, event_main_destroys);
+
     } else {
         log_debug("%d[%p]", event->fd, event);
 
-        TAILQ_REMOVE(&event->event_main->events, event, event_main_events);
+        TAILQ_REMOVE(&event_main->events, event, event_main_events);
 
         free(event);
     }
 }
 
-int event_main_run (struct event_main *event_main)
+void event_dispatch (struct event_main *event_main, struct event *event, int flags)
 {
-    fd_set read, write;
-    int err;
+    if (event->destroy) {
+        log_debug("ignore destroyed event %d[%p] activation", event->fd, event);
 
-    while (true) {
-        int nfds = 0, ret;
-        struct event *event;
-        struct timeval event_timeout = { 0, 0 };
-        struct event *timeout_event = NULL;
+    } else if (event->handler) {
+        event->handler(event_main, event, flags);
 
-        FD_ZERO(&read);
-        FD_ZERO(&write);
+    } else if (event->task) {
+        struct event_task *task = event->task;
 
-        // event_destroy -safe loop...
-        struct event *event_next;
+        event->flags = flags;
+        task->event = event;
 
-        for (event = TAILQ_FIRST(&event_main->events); event; event = event_next) {
-            event_next = TAILQ_NEXT(event, event_main_events);
+        // this may event_destroy(event)
+        event_switch(event_main, &task);
 
-            // ...delayed GC
-            if (event->destroy) {
-                event_destroy(event);
-                continue;
-            }
+    } else {
+        log_fatal("spurious event %d[%p] activation", event->fd, event);
+    }
+}
 
-            // select's FD_SET only supports fd's under a certain limit (e.g. 1k), larger ones invoke undefined behaviour.
-            assert(event->fd < FD_SETSIZE);
-                
-            if (event->flags & EVENT_READ)
-                FD_SET(event->fd, &read);
-            
-            if (event->flags & EVENT_WRITE)
-                FD_SET(event->fd, &write);
-
-            if (event->flags & EVENT_TIMEOUT) {
-                if (!event_timeout.tv_sec || event->timeout.tv_sec < event_timeout.tv_sec || (   
-                        event->timeout.tv_sec == event_timeout.tv_sec 
-                    &&  event->timeout.tv_usec < event_timeout.tv_usec
-                )) {
-                    event_timeout = event->timeout;
-                    timeout_event = event;
-                }
-            }
+void event_schedule (struct event_main *event_main, struct event_task *task)
+{
+    log_debug("%s[%p]", task->name, task);
+
+    TAILQ_INSERT_TAIL(&event_main->runq, task, event_main_runq);
+    event_main->pending++;
+}
+
+/*
+ * Resume the tasks scheduled before this call.
+ *
+ * Tasks scheduled while running these are only run on the next iteration, after polling for IO.
+ */
+static void event_main_runq (struct event_main *event_main)
+{
+    struct event_main_runq runq = TAILQ_HEAD_INITIALIZER(runq);
+    struct event_task *task;
+
+    TAILQ_CONCAT(&runq, &event_main->runq, event_main_runq);
+
+    while ((task = TAILQ_FIRST(&runq))) {
+        TAILQ_REMOVE(&runq, task, event_main_runq);
+        event_main->pending--;
+
+        event_switch(event_main, &task);
+    }
+}
+
+/*
+ * Start up to spawn_max of the tasks from event_spawn(), in order.
+ */
+static void event_main_spawns (struct event_main *event_main)
+{
+    struct event_task *task;
 
-            // mark as active event
-            if (event->flags && event->fd >= nfds)
-                nfds = event->fd + 1;
+    for (unsigned count = 0; (task = TAILQ_FIRST(&event_main->spawns)); count++) {
+        if (event_main->spawn_max && count >= event_main->spawn_max) {
+            log_debug("deferring %u tasks", event_main->spawns_count);
+            break;
         }
 
-        if (!nfds) {
+        TAILQ_REMOVE(&event_main->spawns, task, event_main_runq);
+        event_main->spawns_count--;
+        event_main->pending--;
+
+        if (event_task_boot(event_main, task))
+            log_error("event_task_boot");
+    }
+}
+
+/*
+ * Release any events that were event_destroy()'d from within a task, once the backend is done with them.
+ */
+static void event_main_gc (struct event_main *event_main)
+{
+    struct event *event, *next;
+
+    for (event = TAILQ_FIRST(&event_main->destroys); event; event = next) {
+        next = TAILQ_NEXT(event, event_main_destroys);
+
+        if (event->backend_refs || !TAILQ_EMPTY(&event->waits))
+            continue;
+
+        log_debug("%d[%p]", event->fd, event);
+
+        TAILQ_REMOVE(&event_main->destroys, event, event_main_destroys);
+        TAILQ_REMOVE(&event_main->events, event, event_main_events);
+
+        free(event);
+    }
+}
+
+/*
+ * Return the elapsed time between the given timestamps in microseconds, or zero if end is before start.
+ */
+static unsigned long event_elapsed (const struct timeval *start, const struct timeval *end)
+{
+    struct timeval elapsed;
+
+    if (timercmp(end, start, <))
+        return 0;
+
+    timersub(end, start, &elapsed);
+
+    return elapsed.tv_sec * 1000000UL + elapsed.tv_usec;
+}
+
+static void event_histogram_add (struct event_histogram *histogram, unsigned long value)
+{
+    unsigned bucket = 0;
+
+    if (value)
+        bucket = sizeof(value) * 8 - __builtin_clzl(value);
+
+    if (bucket >= EVENT_HISTOGRAM_BUCKETS)
+        bucket = EVENT_HISTOGRAM_BUCKETS - 1;
+
+    histogram->count++;
+    histogram->sum += value;
+    histogram->buckets[bucket]++;
+
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+void event_main_wakeup (struct event_main *event_main, int ready)
+{
+    struct timeval wait;
+
+    // the start of the wait was recorded by event_main_run()
+    wait = event_main->now;
+
+    if (timestamp_now(&event_main->now)) {
+        log_warning("timestamp_now");
+        return;
+    }
+
+    event_histogram_add(&event_main->stats.wait_time, event_elapsed(&wait, &event_main->now));
+
+    if (ready > 0)
+        event_histogram_add(&event_main->stats.wait_ready, ready);
+}
+
+const struct event_task_stats *event_main_task_stats (struct event_main *event_main, const struct event_task_stats *prev)
+{
+    struct event_task_name *task_name;
+
+    // the stats are the first member
+    if (prev) {
+        task_name = TAILQ_NEXT((struct event_task_name *) prev, event_main_task_names);
+    } else {
+        task_name = TAILQ_FIRST(&event_main->task_names);
+    }
+
+    return task_name ? &task_name->stats : NULL;
+}
+
+void event_main_stats (struct event_main *event_main, struct event_stats *stats)
+{
+    *stats = event_main->stats;
+
+    stats->stacks_pooled = event_main->stacks_count;
+    stats->spawning = event_main->spawns_count;
+    stats->pending = event_main->pending;
+    stats->timers = event_main->timers_count;
+}
+
+int event_main_run (struct event_main *event_main)
+{
+    const struct event_backend *backend = event_main->backend;
+
+    while (true) {
+        struct event_timer *timer;
+        struct timeval now;
+        int ret;
+
+        // waiters on events that nobody yielded on during the previous iteration
+        event_main_orphans(event_main);
+
+        // delayed GC
+        event_main_gc(event_main);
+
+        if (!event_main->pending) {
             log_info("exit");
             return 0;
         }
 
-        // select, with timeout?
-        if (timeout_event) {
-            struct timeval select_timeout;
+        if (timestamp_now(&now)) {
+            log_error("timestamp_now");
+            return -1;
+        }
+
+        // the previous iteration ran from the backend wakeup until now
+        if (event_main->stats.iterations++)
+            event_histogram_add(&event_main->stats.iteration_time, event_elapsed(&event_main->now, &now));
 
-            // convert event_timeout timestamp -> select timeout
-            // if the event_timeout is in the past, we sill simply poll select and notify the timeout on this iteration..
-            //  XXX: select() may return nonzero even with a zero timeout, meaning that we don't service this timeout
-            //       until we are otherwise idle on IO..
-            if ((err = timeout_from_timestamp(&select_timeout, &event_timeout)) < 0) {
-                log_warning("timestamp_timeout");
-                return -1;
-            } else if (err) {
-                log_warning("event[%p] timeout in past", timeout_event);
-            }
+        // start of the wait, updated by event_main_wakeup()
+        event_main->now = now;
+
+        // wait, with timeout?
+        if (!TAILQ_EMPTY(&event_main->runq) || !TAILQ_EMPTY(&event_main->spawns)) {
+            struct timeval wait_timeout = { 0, 0 };
 
-            log_debug("select: %d timeout=%ld:%ld", nfds, select_timeout.tv_sec, select_timeout.tv_usec);
-            
-            ret = select(nfds, &read, &write, NULL, &select_timeout);
+            // poll for IO before resuming or starting any scheduled tasks
+            log_debug("%s: %u runq", backend->name, event_main->pending);
+
+            ret = backend->wait(event_main, &wait_timeout);
+
+        } else if (event_main->timers_count) {
+            struct timeval wait_timeout;
+
+            // convert the earliest timer timestamp -> wait timeout
+            // if the timer is in the past, we will simply poll and expire it on this iteration..
+            event_main_timeout(event_main, &wait_timeout, &event_main->timers[1]->timeout);
+
+            log_debug("%s: %u timeout=%ld:%ld", backend->name, event_main->pending, wait_timeout.tv_sec, wait_timeout.tv_usec);
+
+            ret = backend->wait(event_main, &wait_timeout);
 
         } else {
-            log_debug("select: %d", nfds);
+            log_debug("%s: %u", backend->name, event_main->pending);
 
-            ret = select(nfds, &read, &write, NULL, NULL);
+            ret = backend->wait(event_main, NULL);
         }
-        
+
         if (ret < 0) {
-            log_perror("select");
+            log_error("%s", backend->name);
             return -1; 
         }
-        
-        if (!ret) {
-            // timed out
-            if (!timeout_event) {
-                log_error("select timeout without event?!");
-            } else {
-                struct event_task *task = timeout_event->task;
-
-                // notify
-                timeout_event->flags = EVENT_TIMEOUT;
-                task->event = timeout_event;
-                
-                // NOTE: this may event_destroy(timeout_event)
-                event_switch(event_main, &task);
-            }
-        } else {
-            // event_destroy -safe loop...
-            struct event *event_next;
-
-            for (event = TAILQ_FIRST(&event_main->events); event; event = event_next) {
-                event_next = TAILQ_NEXT(event, event_main_events);
-
-                int flags = 0;
-
-                if (FD_ISSET(event->fd, &read) && (event->flags & EVENT_READ))
-                    flags |= EVENT_READ;
-                
-                if (FD_ISSET(event->fd, &write) && (event->flags & EVENT_WRITE))
-                    flags |= EVENT_WRITE;
-
-                if (!flags) {
-                    // maybe next time!
-                
-                } else if (event->task) {
-                    struct event_task *task = event->task;
-
-                    event->flags = flags;
-                    task->event = event;
-                    
-                    // this may event_destroy(event)
-                    event_switch(event_main, &task);
-                } else if (event->destroy) {
-                    log_debug("ignore destroyed event %d[%p] activation", event->fd, event);
-                } else {
-                    log_fatal("spurious event %d[%p] activation", event->fd, event);
-                }
+
+        if (event_main->timers_count) {
+            now = event_main->now;
+
+            // expire all timers up to the backend wakeup, those expiring while dispatching IO on the next iteration
+            // timers re-armed for the present from within the timer func are only expired on the next iteration
+            while (event_main->timers_count && timercmp(&(timer = event_main->timers[1])->timeout, &now, <)) {
+                event_histogram_add(&event_main->stats.timer_lag, event_elapsed(&timer->timeout, &now));
+
+                event_timer_disarm(event_main, timer);
+
+                // NOTE: this may event_destroy() the timer's event
+                timer->func(event_main, timer);
             }
         }
+
+        // tasks woken from event_queue_wait()
+        event_main_runq(event_main);
+
+        // new tasks from event_spawn()
+        event_main_spawns(event_main);
     }
 }
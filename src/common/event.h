@@ -1,6 +1,7 @@
 #ifndef EVENT_H
 #define EVENT_H
 
+#include <stddef.h>
 #include <sys/time.h>
 
 enum event_flag {
@@ -8,16 +9,142 @@ enum event_flag {
     EVENT_WRITE     = 0x02,
 
     EVENT_TIMEOUT   = 0x08,
+
+    /* event_io() operation completed */
+    EVENT_IO        = 0x10,
+};
+
+/*
+ * Asynchronous IO operations for event_io().
+ */
+enum event_io_op {
+    /* recv() into buf, returning the number of bytes read */
+    EVENT_IO_READ,
+
+    /* send() from buf, returning the number of bytes written */
+    EVENT_IO_WRITE,
+
+    /* accept() on a listening socket, returning the new socket */
+    EVENT_IO_ACCEPT,
+
+    /* send() from the struct iovec array buf with size entries, returning the number of bytes written */
+    EVENT_IO_WRITEV,
 };
 
 /*
- * Maximum stack size for event_task's.
+ * Default stack size for event_task's.
  *
- * This is allocated by event_start using malloc(), and will never grow.
- * However, perhaps we can rely on Linux's lazy malloc() page allocation..
+ * This is mmap()'d by event_start with a guard page below it, and will never grow.
+ * However, we can rely on Linux's lazy page allocation..
  */
 #define EVENT_TASK_SIZE 65536
 
+/*
+ * Maximum number of stacks from exited tasks kept for re-use by each event_main.
+ *
+ * Pooled stacks keep their mapping, but release their dirtied pages.
+ */
+#define EVENT_STACK_POOL 1024
+
+/*
+ * Default maximum size of the buffers taken from each event_main's pool, e.g. for growing connection streams.
+ */
+#define EVENT_BUF_SIZE (64 * 1024)
+
+/*
+ * Maximum number of free buffers of each size kept for re-use by each event_main.
+ */
+#define EVENT_BUF_POOL 256
+
+/*
+ * Default threshold in microseconds for a task to run between switches before it is logged as slow.
+ */
+#define EVENT_TASK_SLOW 100000
+
+/*
+ * Default maximum number of event_spawn()'d tasks started on each event_main iteration.
+ */
+#define EVENT_SPAWN_MAX 64
+
+/*
+ * Number of power-of-two buckets in each event_histogram.
+ */
+#define EVENT_HISTOGRAM_BUCKETS 24
+
+/*
+ * Distribution of values: bucket 0 counts zero values, and bucket i counts values in [2^(i-1), 2^i).
+ *
+ * The last bucket also counts any larger values.
+ */
+struct event_histogram {
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+
+    unsigned long buckets[EVENT_HISTOGRAM_BUCKETS];
+};
+
+/*
+ * Counters for event_main_run(). Durations are in microseconds.
+ */
+struct event_stats {
+    // loop iterations
+    unsigned long iterations;
+
+    // time spent running tasks and timers for each iteration, between backend waits
+    struct event_histogram iteration_time;
+
+    // time blocked in the backend waiting for events
+    struct event_histogram wait_time;
+
+    // number of ready events per backend wakeup
+    struct event_histogram wait_ready;
+
+    // how late timeouts fire after their deadline
+    struct event_histogram timer_lag;
+
+    // event_switch() into a task
+    unsigned long switches;
+
+    // live tasks, and the size of their stacks
+    unsigned tasks;
+    size_t stack_bytes;
+
+    // stacks kept for re-use
+    unsigned stacks_pooled;
+
+    // free buffers kept for re-use, in bytes
+    size_t buf_bytes_pooled;
+
+    // event_spawn()'d tasks not yet started
+    unsigned spawning;
+
+    // events with a pending task, armed timers
+    unsigned pending;
+    unsigned timers;
+
+    // task slices exceeding the event_main_set_slow_task() threshold
+    unsigned long slow_slices;
+};
+
+/*
+ * Cumulative time spent running tasks with the same name, between switches. Durations are in microseconds.
+ */
+struct event_task_stats {
+    const char *name;
+
+    // started tasks
+    unsigned long tasks;
+
+    // slices of execution between switches
+    unsigned long slices;
+    unsigned long time;
+    unsigned long max;
+
+    // slices exceeding the event_main_set_slow_task() threshold
+    unsigned long slow;
+};
+
 
 /*
  * IO reactor.
@@ -27,12 +154,80 @@ struct event;
 struct event_task;
 
 typedef void (event_task_func)(void *ctx);
+typedef void (event_post_func)(void *ctx);
+typedef void (event_offload_func)(void *ctx);
 
 /*
  * Prepare a new event_main for use; initially empty.
+ *
+ * An event_main, and all of its events and tasks, must only be used from a single thread at a time. It may be
+ * prepared in one thread and then handed off to another thread for event_main_run().
  */
 int event_main_create (struct event_main **event_mainp);
 
+/*
+ * Prepare the calling thread for running tasks, when using event_main's from threads other than the main thread.
+ */
+int event_thread_init (void);
+void event_thread_cleanup (void);
+
+/*
+ * Set the stack size used for new tasks, rounded up to the page size.
+ *
+ * Any pooled stacks of a different size are released.
+ */
+int event_main_set_stack_size (struct event_main *event_main, size_t size);
+
+/*
+ * Set the threshold in microseconds for a task to run between switches before it is logged and counted as slow, or
+ * 0 to disable. Defaults to EVENT_TASK_SLOW.
+ */
+void event_main_set_slow_task (struct event_main *event_main, unsigned long usec);
+
+/*
+ * Set the maximum number of event_spawn()'d tasks to start on each iteration, or 0 for no limit. Defaults to
+ * EVENT_SPAWN_MAX.
+ */
+void event_main_set_spawn_max (struct event_main *event_main, unsigned max);
+
+/*
+ * Set the maximum size of buffers to take from the event_main's pool, rounded up to a power of two. Defaults to
+ * EVENT_BUF_SIZE.
+ *
+ * This must be set before any buffers are pooled, as the pool does not know how to release them.
+ */
+int event_main_set_buf_size (struct event_main *event_main, size_t size);
+size_t event_main_buf_size (struct event_main *event_main);
+
+/*
+ * Take a free buffer of the given power-of-two size from the event_main's pool, as returned by event_main_buf_put().
+ *
+ * The pool does not allocate any buffers itself, and only keeps them as-is. Returns NULL if there are none.
+ */
+void * event_main_buf_get (struct event_main *event_main, size_t size);
+
+/*
+ * Return an unused buffer of the given power-of-two size to the event_main's pool, for re-use by the same thread.
+ *
+ * Returns 1 if the pool is full, or the size is not pooled, in which case the caller must release the buffer itself.
+ */
+int event_main_buf_put (struct event_main *event_main, void *buf, size_t size);
+
+/*
+ * Convert the given timeout into a future timestamp from the present, using the time cached by the event_main on each
+ * iteration, instead of reading the clock.
+ *
+ * The timestamps use the CLOCK_MONOTONIC from timestamp_now(), unaffected by wall-clock changes.
+ */
+void event_main_timestamp (struct event_main *event_main, struct timeval *timestamp, const struct timeval *timeout);
+
+/*
+ * Convert the given future timestamp into a timeout from the present, using the time cached by the event_main.
+ *
+ * Sets timeout to (0, 0) and returns 1 if timestamp is in the past, 0 otherwise.
+ */
+int event_main_timeout (struct event_main *event_main, struct timeval *timeout, const struct timeval *timestamp);
+
 /*
  * Return the limit on acceptable fd's for use with event_create.
  * The returned value is the number of acceptable FDs, i.e. fd == max is invalid.
@@ -54,6 +249,49 @@ int event_create (struct event_main *event_main, struct event **eventp, int fd);
 int _event_start (struct event_main *event_main, const char *name, event_task_func *func, void *ctx);
 #define event_start(event_main, func, ctx) _event_start(event_main, #func, func, ctx)
 
+/*
+ * Queue up the given event task to be started from event_main(), instead of switching into it immediately.
+ *
+ * The tasks are started in order, once any IO ready on the same iteration has been dispatched, and at most
+ * event_main_set_spawn_max() per iteration; their stacks are only allocated once started.
+ */
+int _event_spawn (struct event_main *event_main, const char *name, event_task_func *func, void *ctx);
+#define event_spawn(event_main, func, ctx) _event_spawn(event_main, #func, func, ctx)
+
+/*
+ * Schedule the given func to be called from within the event_main, on its next iteration.
+ *
+ * This is safe to call from any thread, and wakes up the event_main if it is waiting for events. The posted funcs are
+ * called in order, outside of any task.
+ *
+ * Note that the event_main will still exit once it has no pending tasks, regardless of any other threads that may
+ * still be posting to it.
+ */
+int event_main_post (struct event_main *event_main, event_post_func *func, void *ctx);
+
+/*
+ * Boot up the given event task from any thread, within the event_main on its next iteration.
+ */
+int _event_post_start (struct event_main *event_main, const char *name, event_task_func *func, void *ctx);
+#define event_post_start(event_main, func, ctx) _event_post_start(event_main, #func, func, ctx)
+
+/*
+ * Number of worker threads used for event_offload(), shared by all event_mains.
+ */
+#define EVENT_OFFLOAD_THREADS 4
+
+/*
+ * Run the given blocking func on a worker thread, suspending the calling task until it returns.
+ *
+ * Other tasks on the event_main keep running meanwhile, and the event_main will not exit while the task is offloaded.
+ * The func must not use the event_main, and any results should be returned via ctx.
+ *
+ * Outside of any task, or with a NULL event_main, the func is just called directly.
+ *
+ * Returns <0 on error, without having called func.
+ */
+int event_offload (struct event_main *event_main, event_offload_func *func, void *ctx);
+
 /*
  * Test if the given event is already pending on (some other task has yielded on it).
  *
@@ -81,22 +319,93 @@ int event_main_yield (struct event_main *event_main, struct event **eventp);
  *  flags:          some combination of EVENT_READ|EVENT_WRITE.
  *  timeout:        relative timeout until returning 1 for timeout.
  *
+ * Readiness may be edge-triggered: the task must first attempt the read/write operation until it fails with EAGAIN,
+ * as any readiness from before that may not be reported again. Spurious wakeups are also possible.
+ *
  * Returns 0 on success (event happaned), 1 on timeout (event did not happen), <0 on error.
  */
 int event_yield (struct event *event, int flags, const struct timeval *timeout);
 
+/*
+ * Test if the event_main backend supports event_io() on the given event.
+ */
+int event_io_supported (struct event *event);
+
+/*
+ * Submit the given IO operation on the event's fd to the event_main backend, and yield until it has completed.
+ *
+ * The buf must remain valid until this returns; an operation that times out is cancelled before returning.
+ *
+ * Returns 0 on success with *resp set to the result, 1 on timeout, <0 on error with errno set.
+ */
+int event_io (struct event *event, enum event_io_op op, void *buf, size_t size, const struct timeval *timeout, int *resp);
+
 /*
  * Pause execution until the next event-loop iteration.
  */
 int event_sleep (struct event *event, const struct timeval *timeout);
 
+/*
+ * Let other tasks run, resuming the current task from the back of the event_main's run queue on the next iteration.
+ *
+ * This does not require any event or timer, and is intended for long-running tasks to split up their work.
+ *
+ * Returns 0 once resumed, <0 if not called from within a task.
+ */
+int event_yield_now (struct event_main *event_main);
+
 /*
  * Yield execution on given event, waiting for the task that has event_yield()'d on that event to event_notify() us.
  *
- * TODO: some kind of tracking of dead tasks that are waiting on an event that nobody is yielding on.
- * TODO: support for timeouts
+ * The task yielding on the event is responsible for notifying any waiting tasks. If there is no longer any task
+ * yielding on the event once the event_main regains control, e.g. because the task exited, or the event is destroyed,
+ * then the waiting tasks are woken up with an error, one at a time, until one of them yields on the event.
+ *
+ * timeout is a relative timeout, or NULL to wait indefinitely.
+ *
+ * Returns 0 when notified, 1 on timeout, <0 with errno=EPIPE if orphaned.
+ */
+int event_wait (struct event *event, struct event_task **waitp, const struct timeval *timeout);
+
+/*
+ * Queue of tasks waiting for some condition, such as a shared resource becoming available.
+ *
+ * Woken tasks are resumed from event_main(), rather than from within the waking task.
+ */
+struct event_queue;
+
+/*
+ * Prepare a new queue for tasks of the given event_main.
+ */
+int event_queue_create (struct event_main *event_main, struct event_queue **queuep);
+
+/*
+ * Suspend the current task on the queue, until woken up by event_queue_wake() or event_queue_wake_all().
+ *
+ * timeout is a relative timeout, or NULL to wait indefinitely. Waiting tasks do not keep the event_main running.
+ *
+ * Returns 0 when woken, 1 on timeout, <0 with errno=EPIPE if the queue was destroyed.
  */
-int event_wait (struct event *event, struct event_task **waitp);
+int event_queue_wait (struct event_queue *queue, const struct timeval *timeout);
+
+/*
+ * Wake up the first task waiting on the queue.
+ *
+ * Returns 1 if a task was woken, 0 if there were no waiting tasks.
+ */
+int event_queue_wake (struct event_queue *queue);
+
+/*
+ * Wake up all tasks waiting on the queue.
+ *
+ * Returns the number of woken tasks.
+ */
+int event_queue_wake_all (struct event_queue *queue);
+
+/*
+ * Release the queue, waking up any waiting tasks with an error.
+ */
+void event_queue_destroy (struct event_queue *queue);
 
 /*
  * Transfer execution from a task that has event_yield()'d on the given event to the task that has event_wait()'d on the same event.
@@ -118,4 +427,18 @@ void event_destroy (struct event *event);
  */
 int event_main_run (struct event_main *event_main);
 
+/*
+ * Copy out the current event_main_run() counters.
+ *
+ * This must be called from the event_main's own thread, e.g. from within one of its tasks.
+ */
+void event_main_stats (struct event_main *event_main, struct event_stats *stats);
+
+/*
+ * Iterate over the per-name task stats, starting from NULL. Returns NULL once done.
+ *
+ * The same thread restrictions as for event_main_stats() apply.
+ */
+const struct event_task_stats *event_main_task_stats (struct event_main *event_main, const struct event_task_stats *prev);
+
 #endif
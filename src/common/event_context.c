@@ -0,0 +1,219 @@
+#include "common/event_internal.h"
+
+#include "common/log.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef EVENT_CONTEXT_ASM
+
+/*
+ * Save the callee-saved registers on the current stack, store the stack pointer into *savep, and switch to the given
+ * stack pointer, restoring the registers saved there.
+ *
+ * Everything else is caller-saved, and has already been spilled by the compiler around this call. The signal mask and
+ * floating-point control state are shared by all tasks, and left alone.
+ */
+void event_context_swap (void **savep, void *sp);
+
+/*
+ * Initial return address for a new context, calling func(arg) from the restored registers. Never returns.
+ */
+void event_context_entry (void);
+
+#if defined(__x86_64__)
+
+/*
+ * Stack frame: r15 r14 r13 r12 rbx rbp <return address>
+ */
+#define EVENT_CONTEXT_FRAME 7
+
+#define EVENT_CONTEXT_FUNC 2
+#define EVENT_CONTEXT_ARG 3
+#define EVENT_CONTEXT_RETURN 6
+
+__asm__ (
+    "   .pushsection .text\n"
+    "   .globl  event_context_swap\n"
+    "   .type   event_context_swap, @function\n"
+    "event_context_swap:\n"
+    "   pushq   %rbp\n"
+    "   pushq   %rbx\n"
+    "   pushq   %r12\n"
+    "   pushq   %r13\n"
+    "   pushq   %r14\n"
+    "   pushq   %r15\n"
+    "   movq    %rsp, (%rdi)\n"
+    "   movq    %rsi, %rsp\n"
+    "   popq    %r15\n"
+    "   popq    %r14\n"
+    "   popq    %r13\n"
+    "   popq    %r12\n"
+    "   popq    %rbx\n"
+    "   popq    %rbp\n"
+    "   ret\n"
+    "   .size   event_context_swap, .-event_context_swap\n"
+
+    "   .globl  event_context_entry\n"
+    "   .type   event_context_entry, @function\n"
+    "event_context_entry:\n"
+    "   movq    %r12, %rdi\n"
+    "   callq   *%r13\n"
+    "   ud2\n"
+    "   .size   event_context_entry, .-event_context_entry\n"
+    "   .popsection\n"
+);
+
+#elif defined(__aarch64__)
+
+/*
+ * Stack frame: x19-x28 x29 x30 d8-d15, with x30 as the return address.
+ */
+#define EVENT_CONTEXT_FRAME 20
+
+#define EVENT_CONTEXT_FUNC 1
+#define EVENT_CONTEXT_ARG 0
+#define EVENT_CONTEXT_RETURN 11
+
+__asm__ (
+    "   .pushsection .text\n"
+    "   .globl  event_context_swap\n"
+    "   .type   event_context_swap, %function\n"
+    "event_context_swap:\n"
+    "   sub     sp, sp, #160\n"
+    "   stp     x19, x20, [sp, #0]\n"
+    "   stp     x21, x22, [sp, #16]\n"
+    "   stp     x23, x24, [sp, #32]\n"
+    "   stp     x25, x26, [sp, #48]\n"
+    "   stp     x27, x28, [sp, #64]\n"
+    "   stp     x29, x30, [sp, #80]\n"
+    "   stp     d8, d9, [sp, #96]\n"
+    "   stp     d10, d11, [sp, #112]\n"
+    "   stp     d12, d13, [sp, #128]\n"
+    "   stp     d14, d15, [sp, #144]\n"
+    "   mov     x2, sp\n"
+    "   str     x2, [x0]\n"
+    "   mov     sp, x1\n"
+    "   ldp     x19, x20, [sp, #0]\n"
+    "   ldp     x21, x22, [sp, #16]\n"
+    "   ldp     x23, x24, [sp, #32]\n"
+    "   ldp     x25, x26, [sp, #48]\n"
+    "   ldp     x27, x28, [sp, #64]\n"
+    "   ldp     x29, x30, [sp, #80]\n"
+    "   ldp     d8, d9, [sp, #96]\n"
+    "   ldp     d10, d11, [sp, #112]\n"
+    "   ldp     d12, d13, [sp, #128]\n"
+    "   ldp     d14, d15, [sp, #144]\n"
+    "   add     sp, sp, #160\n"
+    "   ret\n"
+    "   .size   event_context_swap, .-event_context_swap\n"
+
+    "   .globl  event_context_entry\n"
+    "   .type   event_context_entry, %function\n"
+    "event_context_entry:\n"
+    "   mov     x0, x19\n"
+    "   blr     x20\n"
+    "   brk     #0\n"
+    "   .size   event_context_entry, .-event_context_entry\n"
+    "   .popsection\n"
+);
+
+#else
+#error "ASM_CONTEXT is only supported on x86_64 and aarch64, build without it to use libpcl"
+#endif
+
+/*
+ * Run the context's func on its own stack, and switch back to the caller once it returns, for the last time.
+ */
+static void event_context_main (void *arg)
+{
+    struct event_context *context = arg;
+
+    context->func(context->arg);
+
+    event_context_resume(context);
+
+    log_fatal("context[%p] resumed after exit", context);
+    abort();
+}
+
+int event_context_thread_init (void)
+{
+    return 0;
+}
+
+void event_context_thread_cleanup (void)
+{
+
+}
+
+int event_context_create (struct event_context *context, void (*func)(void *), void *arg, void *stack, size_t size)
+{
+    // the top of the stack, aligned such that the entry is called with an aligned stack
+    uintptr_t top = ((uintptr_t) stack + size) & ~(uintptr_t) 15;
+    void **frame = (void **) (top - 16) - EVENT_CONTEXT_FRAME;
+
+    context->func = func;
+    context->arg = arg;
+
+    for (int i = 0; i < EVENT_CONTEXT_FRAME; i++)
+        frame[i] = NULL;
+
+    frame[EVENT_CONTEXT_FUNC] = (void *) event_context_main;
+    frame[EVENT_CONTEXT_ARG] = context;
+    frame[EVENT_CONTEXT_RETURN] = (void *) event_context_entry;
+
+    context->sp = frame;
+    context->caller = NULL;
+
+    return 0;
+}
+
+void event_context_call (struct event_context *context)
+{
+    event_context_swap(&context->caller, context->sp);
+}
+
+void event_context_resume (struct event_context *context)
+{
+    event_context_swap(&context->sp, context->caller);
+}
+
+#else
+
+int event_context_thread_init (void)
+{
+    if (co_thread_init()) {
+        log_error("co_thread_init");
+        return -1;
+    }
+
+    return 0;
+}
+
+void event_context_thread_cleanup (void)
+{
+    co_thread_cleanup();
+}
+
+int event_context_create (struct event_context *context, void (*func)(void *), void *arg, void *stack, size_t size)
+{
+    if (!(context->co = co_create(func, arg, stack, size))) {
+        log_perror("co_create");
+        return -1;
+    }
+
+    return 0;
+}
+
+void event_context_call (struct event_context *context)
+{
+    co_call(context->co);
+}
+
+void event_context_resume (struct event_context *context)
+{
+    co_resume();
+}
+
+#endif
@@ -0,0 +1,119 @@
+#include "common/event_internal.h"
+
+#include "common/log.h"
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+/*
+ * Maximum number of ready events returned per epoll_wait().
+ */
+#define EVENT_EPOLL_MAX 64
+
+/*
+ * Linux epoll() backend.
+ *
+ * Each event is registered once in event_create() for both EVENT_READ and EVENT_WRITE, edge-triggered, and only
+ * removed in event_destroy(). Yielding on an event does not require any syscalls, and readiness is only reported
+ * once per edge; any edges that occur without any task waiting for them are dropped.
+ */
+static int event_epoll_create (struct event_main *event_main)
+{
+    if ((event_main->fd = epoll_create1(EPOLL_CLOEXEC)) >= 0) {
+        return 0;
+
+    } else if (errno == ENOSYS) {
+        return 1;
+
+    } else {
+        log_perror("epoll_create1");
+        return -1;
+    }
+}
+
+static int event_epoll_max (struct event_main *event_main)
+{
+    return 0;
+}
+
+static int event_epoll_add (struct event_main *event_main, struct event *event)
+{
+    struct epoll_event ev = {
+        .events     = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr   = event,
+    };
+
+    if (epoll_ctl(event_main->fd, EPOLL_CTL_ADD, event->fd, &ev)) {
+        log_perror("epoll_ctl ADD %d", event->fd);
+        return -1;
+    }
+
+    event->backend_flags = EVENT_READ | EVENT_WRITE;
+
+    return 0;
+}
+
+static void event_epoll_del (struct event_main *event_main, struct event *event)
+{
+    // the fd may remain open after the event is destroyed
+    if (epoll_ctl(event_main->fd, EPOLL_CTL_DEL, event->fd, NULL))
+        log_pwarning("epoll_ctl DEL %d", event->fd);
+
+    event->backend_flags = 0;
+}
+
+static int event_epoll_wait (struct event_main *event_main, const struct timeval *timeout)
+{
+    struct epoll_event events[EVENT_EPOLL_MAX];
+    int ms = -1, ret;
+
+    if (timeout) {
+        // round up, to avoid spinning on sub-millisecond timeouts
+        ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+    }
+
+    while ((ret = epoll_wait(event_main->fd, events, EVENT_EPOLL_MAX, ms)) < 0 && errno == EINTR)
+        ;
+
+    if (ret < 0) {
+        log_perror("epoll_wait");
+        return -1;
+    }
+
+    event_main_wakeup(event_main, ret);
+
+    // the events remain valid until we return, even if they are event_destroy()'d
+    for (int i = 0; i < ret; i++) {
+        struct event *event = events[i].data.ptr;
+        int flags = 0;
+
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            flags |= EVENT_READ;
+
+        if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            flags |= EVENT_WRITE;
+
+        if (event->destroy) {
+            continue;
+
+        } else if (!(flags & event->flags)) {
+            // nobody is interested, and the task will try again before yielding
+            continue;
+        }
+
+        // this may event_destroy(event)
+        event_dispatch(event_main, event, flags & event->flags);
+    }
+
+    return ret;
+}
+
+const struct event_backend event_epoll_backend = {
+    .name       = "epoll",
+    .create     = event_epoll_create,
+    .max        = event_epoll_max,
+    .add        = event_epoll_add,
+    .del        = event_epoll_del,
+    .wait       = event_epoll_wait,
+};
@@ -0,0 +1,466 @@
+#ifndef EVENT_INTERNAL_H
+#define EVENT_INTERNAL_H
+
+#include "common/event.h"
+
+#include <stdbool.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#ifndef EVENT_CONTEXT_ASM
+#include <pcl.h>
+#endif
+
+/*
+ * IO multiplexing backend used by event_main_run().
+ *
+ * The backend is responsible for tracking the EVENT_READ/EVENT_WRITE interest for each event, and waiting for
+ * them to become ready, calling event_dispatch() for each ready event.
+ */
+struct event_backend {
+    const char *name;
+
+    /*
+     * Initialize backend state for the event_main.
+     *
+     * Returns <0 on error, 1 if the backend is not supported on this system.
+     */
+    int (*create)(struct event_main *event_main);
+
+    /*
+     * Return the limit on acceptable fd's, or 0 for no limit.
+     */
+    int (*max)(struct event_main *event_main);
+
+    /*
+     * Add a new event.
+     */
+    int (*add)(struct event_main *event_main, struct event *event);
+
+    /*
+     * Optional: update the event's interest to the given EVENT_READ|EVENT_WRITE flags, once a task yields on it.
+     *
+     * Backends that register a persistent interest in add() do not need this.
+     */
+    int (*mod)(struct event_main *event_main, struct event *event, int flags);
+
+    /*
+     * Remove an event, before its fd is closed.
+     *
+     * Any operations still referring to the event must be cancelled, and the event will only be released once
+     * backend_refs drops to zero.
+     */
+    void (*del)(struct event_main *event_main, struct event *event);
+
+    /*
+     * Optional: submit an asynchronous IO operation on the event's fd.
+     *
+     * Once complete, the backend sets event->io_res and calls event_dispatch() with EVENT_IO.
+     */
+    int (*io)(struct event_main *event_main, struct event *event, enum event_io_op op, void *buf, size_t size);
+
+    /*
+     * Optional: cancel a submitted io() operation, which will then complete with -ECANCELED if it was still pending.
+     */
+    int (*cancel)(struct event_main *event_main, struct event *event);
+
+    /*
+     * Wait for events to become ready, and event_dispatch() them.
+     *
+     * timeout is a relative timeout, or NULL to wait indefinitely.
+     *
+     * Returns <0 on error, 0 on timeout, >0 on the number of ready events.
+     */
+    int (*wait)(struct event_main *event_main, const struct timeval *timeout);
+};
+
+extern const struct event_backend event_select_backend;
+extern const struct event_backend event_epoll_backend;
+extern const struct event_backend event_uring_backend;
+
+/*
+ * Func posted to an event_main from some other thread, using event_main_post() or event_post_start().
+ */
+struct event_post {
+    event_post_func *func;
+    void *ctx;
+
+    // event_post_start()
+    const char *task_name;
+    event_task_func *task_func;
+
+    struct event_post *next;
+};
+
+/*
+ * Entry in the event_main's per-name task stats.
+ */
+struct event_task_name {
+    struct event_task_stats stats;
+
+    TAILQ_ENTRY(event_task_name) event_main_task_names;
+};
+
+struct event_timer;
+
+typedef void (event_timer_func)(struct event_main *event_main, struct event_timer *timer);
+
+/*
+ * Absolute timeout, kept in the event_main timer heap while armed.
+ */
+struct event_timer {
+    // absolute timestamp
+    struct timeval timeout;
+
+    // called from event_main_run() once expired, after having been disarmed
+    event_timer_func *func;
+    void *ctx;
+
+    // 1-based position in the event_main timer heap, 0 if not armed
+    unsigned index;
+};
+
+/*
+ * mmap()'d task stack, with a PROT_NONE guard page below it.
+ *
+ * This struct itself lives at the top of the mapping, above the usable stack.
+ */
+struct event_stack {
+    // usable stack, above the guard page
+    void *base;
+    size_t size;
+
+    // full mapping, including the guard page
+    void *map;
+    size_t map_size;
+
+#ifdef VALGRIND
+    int valgrind;
+#endif
+
+    TAILQ_ENTRY(event_stack) event_main_stacks;
+};
+
+/*
+ * Free buffer in the event_main's pool, kept within the buffer itself.
+ */
+struct event_buf {
+    struct event_buf *next;
+};
+
+/*
+ * Number of power-of-two size classes for pooled buffers.
+ */
+#define EVENT_BUF_CLASSES 32
+
+/*
+ * Low-level execution state for a task, using either libpcl or the built-in ASM_CONTEXT switch.
+ */
+struct event_context {
+#ifdef EVENT_CONTEXT_ASM
+    // saved stack pointers for the suspended task, and whoever last event_context_call()'d into it
+    void *sp;
+    void *caller;
+
+    // called on the new stack
+    void (*func)(void *arg);
+    void *arg;
+#else
+    coroutine_t co;
+#endif
+};
+
+struct event_main {
+    // IO multiplexing
+    const struct event_backend *backend;
+
+    // backend state
+    int fd;
+    void *backend_ctx;
+
+    // currently executing task, maintained by event_switch()
+    // NULL when in main() -> event_main()
+    struct event_task *task;
+
+    /*
+     * The set of existing events, which event_main() will operate.
+     *
+     * event_main() will exit once there are no more events left, or none of the
+     * events have any tasks associated.
+     */
+    TAILQ_HEAD(event_main_events, event) events;
+
+    /*
+     * Events that have been event_destroy()'d from within a task, to be released once event_main() is done
+     * dispatching.
+     */
+    TAILQ_HEAD(event_main_destroys, event) destroys;
+
+    /*
+     * Events that have tasks event_wait()'ing on them, checked for orphaned waiters on each iteration.
+     */
+    TAILQ_HEAD(event_main_waits, event) waits;
+
+    /*
+     * Suspended tasks to be resumed on the next iteration, in order. Counted as pending.
+     */
+    TAILQ_HEAD(event_main_runq, event_task) runq;
+
+    /*
+     * New tasks from event_spawn(), to be started on the next iterations, up to spawn_max at a time. Counted as pending.
+     */
+    struct event_main_runq spawns;
+    unsigned spawns_count;
+    unsigned spawn_max;
+
+    /*
+     * Number of events that have a task pending on them.
+     */
+    unsigned pending;
+
+    /*
+     * Binary min-heap of armed timers, ordered by timeout.
+     *
+     * timers[0] is unused, so that the children of timers[i] are timers[2i] and timers[2i + 1].
+     */
+    struct event_timer **timers;
+    unsigned timers_count, timers_size;
+
+    /*
+     * Counters for event_main_stats().
+     */
+    struct event_stats stats;
+
+    /*
+     * Cached CLOCK_MONOTONIC time used for timeouts, refreshed by event_main_run() before waiting on the backend, and
+     * by event_main_wakeup() once it returns.
+     */
+    struct timeval now;
+
+    /*
+     * Per-name task stats, charged by event_switch() for the time since the last switch, in microseconds.
+     */
+    TAILQ_HEAD(event_main_task_names, event_task_name) task_names;
+    struct timespec switch_time;
+    unsigned long slow_task;
+
+    /*
+     * Wakeup for event_main_post(), readable once there are posts.
+     */
+    struct event *post_event;
+
+    /*
+     * Lock-free LIFO stack of posted funcs, pushed by any thread and taken as a whole by the event_main.
+     */
+    struct event_post *posts;
+
+    /*
+     * Pool of stacks from exited tasks, to be re-used by _event_start().
+     */
+    size_t stack_size;
+    TAILQ_HEAD(event_main_stacks, event_stack) stacks;
+    unsigned stacks_count;
+
+    /*
+     * Pool of free buffers for event_main_buf_get(), as LIFO lists for each power-of-two size class, up to buf_size.
+     */
+    size_t buf_size;
+    struct event_buf *bufs[EVENT_BUF_CLASSES];
+    unsigned bufs_count[EVENT_BUF_CLASSES];
+};
+
+struct event {
+    struct event_main *event_main;
+
+    // fixed state
+    int fd;
+
+    /*
+     * The flags will be set to nonzero by event_yield() once some task is pending on this event.
+     *
+     * The flags will be zero when there is no task pending on this event.
+     */
+    int flags;
+
+    /*
+     * The EVENT_READ|EVENT_WRITE interest currently registered with the backend.
+     */
+    int backend_flags;
+
+    /*
+     * Number of backend operations in flight that still refer to this event.
+     *
+     * A destroyed event is only released once these have completed.
+     */
+    unsigned backend_refs;
+
+    /*
+     * Result of the completed event_io() operation, or -errno.
+     */
+    int io_res;
+
+    /*
+     * EVENT_IO_WRITEV message, which must remain valid until the operation completes.
+     */
+    struct msghdr io_msg;
+
+    /*
+     * Absolute timeout for this task, armed when flags & EVENT_TIMEOUT.
+     */
+    struct event_timer timer;
+
+    /*
+     * The task that has yielded on this event.
+     * Only one task may be yielding on an event at any time!
+     *
+     * event_main() will then switch into this task.
+     */
+    struct event_task *task;
+
+    /*
+     * Tasks that have event_wait()'ed on this event, in order.
+     */
+    TAILQ_HEAD(event_waits, event_task) waits;
+
+    /*
+     * Delayed event_destroy() while within event_main()
+     */
+    bool destroy;
+
+    /*
+     * Internal event handled directly by event_dispatch() with a persistent interest in flags, instead of by a task.
+     */
+    void (*handler)(struct event_main *event_main, struct event *event, int flags);
+
+    TAILQ_ENTRY(event) event_main_events;
+    TAILQ_ENTRY(event) event_main_destroys;
+    TAILQ_ENTRY(event) event_main_waits;
+};
+
+struct event_task {
+    struct event_main *event_main;
+
+    // debug info
+    const char *name;
+
+    // stats, shared with other tasks of the same name
+    struct event_task_stats *stats;
+
+    // event_start() execution info
+    event_task_func *func;
+    void *ctx;
+
+    /*
+     * This task has event_register()'d for the given number of events.
+     */
+    int registered;
+
+    /*
+     * This task is event_wait()'ing on some given event, to be event_notify()'d via *waitp.
+     */
+    struct event *wait;
+    struct event_task **waitp;
+
+    /*
+     * This task is event_queue_wait()'ing on the given queue.
+     */
+    struct event_queue *queue;
+
+    // event_wait() or event_queue_wait() timeout
+    struct event_timer wait_timer;
+
+    // event_wait() or event_queue_wait() return value, set by whoever wakes us up
+    int wait_res;
+
+    // event->waits or queue->tasks
+    TAILQ_ENTRY(event_task) event_waits;
+
+    // event_main->runq or event_main->spawns
+    TAILQ_ENTRY(event_task) event_main_runq;
+
+    /*
+     * This task was woken up for the given event.
+     */
+    struct event *event;
+
+    /*
+     * Set within the task once func() returns.
+     *
+     * Used by event_switch() to clean up the task once it has returned.
+     */
+    bool exit;
+
+    // low-level context switch state
+    struct event_context context;
+    struct event_stack *stack;
+};
+
+/*
+ * Prepare the calling thread for event_context_call().
+ */
+int event_context_thread_init (void);
+void event_context_thread_cleanup (void);
+
+/*
+ * Set up a new context to call func(arg) on the given stack, once first event_context_call()'d.
+ */
+int event_context_create (struct event_context *context, void (*func)(void *arg), void *arg, void *stack, size_t size);
+
+/*
+ * Switch into the given context, until it event_context_resume()'s back to us or its func returns.
+ *
+ * Only used by event_switch().
+ */
+void event_context_call (struct event_context *context);
+
+/*
+ * Switch out of the given context, which must be the current one, back to its caller.
+ */
+void event_context_resume (struct event_context *context);
+
+/*
+ * Wake up the task pending on the given event, with the given ready flags.
+ *
+ * Used by the event_backend to dispatch ready events. This may event_destroy() the event.
+ */
+void event_dispatch (struct event_main *event_main, struct event *event, int flags);
+
+/*
+ * Called by the event_backend's wait() once it has returned from blocking, before dispatching any of the given
+ * number of ready events.
+ */
+void event_main_wakeup (struct event_main *event_main, int ready);
+
+/*
+ * Switch into the given task, until it yields or exits. Sets *taskp to NULL if the task exited.
+ */
+void event_switch (struct event_main *event_main, struct event_task **taskp);
+
+/*
+ * Resume the given suspended task from event_main(), on the next iteration.
+ */
+void event_schedule (struct event_main *event_main, struct event_task *task);
+
+/*
+ * Set up the event_main_post() wakeup for a new event_main.
+ */
+int event_post_init (struct event_main *event_main);
+
+/*
+ * Push the given allocated post onto the event_main, waking it up if needed. The post is free()'d once run.
+ *
+ * This is safe to call from any thread.
+ */
+int event_post_push (struct event_main *event_main, struct event_post *post);
+
+/*
+ * Arm the given timer to expire at timer->timeout, re-arming it if already armed.
+ */
+int event_timer_arm (struct event_main *event_main, struct event_timer *timer);
+
+/*
+ * Disarm the given timer, if armed.
+ */
+void event_timer_disarm (struct event_main *event_main, struct event_timer *timer);
+
+#endif
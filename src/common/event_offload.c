@@ -0,0 +1,148 @@
+#include "common/event_internal.h"
+
+#include "common/log.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Task suspended in event_offload(), living on the task's own stack until resumed.
+ */
+struct event_offload {
+    struct event_main *event_main;
+    struct event_task *task;
+
+    event_offload_func *func;
+    void *ctx;
+
+    // posted back to the event_main once func returns
+    struct event_post *post;
+
+    TAILQ_ENTRY(event_offload) offload_queue;
+};
+
+/*
+ * Worker pool shared by all event_mains, started on first use.
+ */
+static struct event_offload_pool {
+    pthread_once_t once;
+    int threads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    TAILQ_HEAD(event_offload_queue, event_offload) queue;
+} event_offload_pool = {
+    .once   = PTHREAD_ONCE_INIT,
+    .mutex  = PTHREAD_MUTEX_INITIALIZER,
+    .cond   = PTHREAD_COND_INITIALIZER,
+    .queue  = TAILQ_HEAD_INITIALIZER(event_offload_pool.queue),
+};
+
+static void *event_offload_worker (void *arg)
+{
+    struct event_offload_pool *pool = arg;
+    struct event_offload *offload;
+
+    while (true) {
+        pthread_mutex_lock(&pool->mutex);
+
+        while (!(offload = TAILQ_FIRST(&pool->queue)))
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+
+        TAILQ_REMOVE(&pool->queue, offload, offload_queue);
+
+        pthread_mutex_unlock(&pool->mutex);
+
+        offload->func(offload->ctx);
+
+        // the post was allocated up front, so this cannot fail on memory
+        if (event_post_push(offload->event_main, offload->post))
+            log_fatal("%s[%p] lost", offload->task->name, offload->task);
+    }
+
+    return NULL;
+}
+
+static void event_offload_start (void)
+{
+    struct event_offload_pool *pool = &event_offload_pool;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int err;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (; pool->threads < EVENT_OFFLOAD_THREADS; pool->threads++) {
+        if ((err = pthread_create(&thread, &attr, event_offload_worker, pool))) {
+            log_warning("pthread_create: %s", strerror(err));
+            break;
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+
+    log_info("%d threads", pool->threads);
+}
+
+/*
+ * The offloaded func has returned, resume the task within the event_main.
+ */
+static void event_offload_resume (void *ctx)
+{
+    struct event_offload *offload = ctx;
+    struct event_main *event_main = offload->event_main;
+    struct event_task *task = offload->task;
+
+    event_main->pending--;
+
+    event_switch(event_main, &task);
+}
+
+int event_offload (struct event_main *event_main, event_offload_func *func, void *ctx)
+{
+    struct event_offload_pool *pool = &event_offload_pool;
+    struct event_task *task = event_main ? event_main->task : NULL;
+    struct event_offload offload = {
+        .event_main = event_main,
+        .task       = task,
+        .func       = func,
+        .ctx        = ctx,
+    };
+
+    if (!task) {
+        // nothing else to run meanwhile
+        func(ctx);
+        return 0;
+    }
+
+    if (pthread_once(&pool->once, event_offload_start) || !pool->threads) {
+        log_error("no worker threads");
+        return -1;
+    }
+
+    if (!(offload.post = calloc(1, sizeof(*offload.post)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    offload.post->func = event_offload_resume;
+    offload.post->ctx = &offload;
+
+    pthread_mutex_lock(&pool->mutex);
+    TAILQ_INSERT_TAIL(&pool->queue, &offload, offload_queue);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    // keep the event_main running until we are resumed
+    event_main->pending++;
+
+    log_debug("<- %s[%p]", task->name, task);
+
+    event_context_resume(&task->context);
+
+    log_debug("-> %s[%p]", task->name, task);
+
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include "common/event_internal.h"
+
+#include "common/log.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * Run the posted funcs, in the order that they were posted.
+ */
+static void event_post_run (struct event_main *event_main, struct event_post *posts)
+{
+    struct event_post *post, *next, *fifo = NULL;
+
+    // reverse the LIFO stack
+    for (post = posts; post; post = next) {
+        next = post->next;
+        post->next = fifo;
+        fifo = post;
+    }
+
+    for (post = fifo; post; post = next) {
+        next = post->next;
+
+        if (post->task_func) {
+            if (_event_start(event_main, post->task_name, post->task_func, post->ctx))
+                log_error("_event_start %s", post->task_name);
+        } else {
+            post->func(post->ctx);
+        }
+
+        free(post);
+    }
+}
+
+/*
+ * The eventfd is readable, take and run any posts.
+ */
+static void event_post_handler (struct event_main *event_main, struct event *event, int flags)
+{
+    struct event_post *posts;
+    uint64_t value;
+
+    // reset the eventfd before taking the posts, so that any later post will wake us up again
+    if (read(event->fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        log_pwarning("read %d", event->fd);
+
+    posts = __atomic_exchange_n(&event_main->posts, NULL, __ATOMIC_ACQUIRE);
+
+    log_debug("%d[%p] posts=%p", event->fd, event, posts);
+
+    event_post_run(event_main, posts);
+
+    // re-arm any one-shot interest
+    if (event_main->backend->mod && event_main->backend->mod(event_main, event, event->flags))
+        log_warning("%s mod %d", event_main->backend->name, event->fd);
+}
+
+int event_post_init (struct event_main *event_main)
+{
+    struct event *event;
+    int fd;
+
+    if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        log_perror("eventfd");
+        return -1;
+    }
+
+    if (event_create(event_main, &event, fd)) {
+        log_error("event_create");
+        close(fd);
+        return -1;
+    }
+
+    // persistent interest, without any pending task
+    event->handler = event_post_handler;
+    event->flags = EVENT_READ;
+
+    if (event_main->backend->mod && event_main->backend->mod(event_main, event, event->flags)) {
+        log_error("%s mod %d", event_main->backend->name, fd);
+        event_destroy(event);
+        close(fd);
+        return -1;
+    }
+
+    event_main->post_event = event;
+
+    return 0;
+}
+
+int event_post_push (struct event_main *event_main, struct event_post *post)
+{
+    struct event_post *head = __atomic_load_n(&event_main->posts, __ATOMIC_RELAXED);
+    uint64_t value = 1;
+
+    do {
+        post->next = head;
+    } while (!__atomic_compare_exchange_n(&event_main->posts, &head, post, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (head) {
+        // the event_main has not yet taken the earlier posts, and will take this one along with them
+        return 0;
+    }
+
+    // EAGAIN if the eventfd counter is saturated, in which case it is readable anyways
+    if (write(event_main->post_event->fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        log_perror("write %d", event_main->post_event->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+int event_main_post (struct event_main *event_main, event_post_func *func, void *ctx)
+{
+    struct event_post *post;
+
+    if (!(post = calloc(1, sizeof(*post)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    post->func = func;
+    post->ctx = ctx;
+
+    return event_post_push(event_main, post);
+}
+
+int _event_post_start (struct event_main *event_main, const char *name, event_task_func *func, void *ctx)
+{
+    struct event_post *post;
+
+    if (!(post = calloc(1, sizeof(*post)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    post->task_name = name;
+    post->task_func = func;
+    post->ctx = ctx;
+
+    return event_post_push(event_main, post);
+}
@@ -0,0 +1,137 @@
+#include "common/event_internal.h"
+
+#include "common/log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+struct event_queue {
+    struct event_main *event_main;
+
+    // waiting tasks, in order
+    struct event_waits tasks;
+};
+
+int event_queue_create (struct event_main *event_main, struct event_queue **queuep)
+{
+    struct event_queue *queue;
+
+    if (!(queue = calloc(1, sizeof(*queue)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    queue->event_main = event_main;
+
+    TAILQ_INIT(&queue->tasks);
+
+    *queuep = queue;
+
+    return 0;
+}
+
+/*
+ * Remove the given task from the queue, with the given event_queue_wait() result.
+ */
+static void event_queue_remove (struct event_queue *queue, struct event_task *task, int res)
+{
+    TAILQ_REMOVE(&queue->tasks, task, event_waits);
+
+    event_timer_disarm(queue->event_main, &task->wait_timer);
+
+    task->queue = NULL;
+    task->wait_res = res;
+}
+
+/*
+ * Timer for an event_queue_wait() with a timeout, resumed directly from event_main().
+ */
+static void event_queue_timeout (struct event_main *event_main, struct event_timer *timer)
+{
+    struct event_task *task = timer->ctx;
+
+    event_queue_remove(task->queue, task, 1);
+
+    event_switch(event_main, &task);
+}
+
+int event_queue_wait (struct event_queue *queue, const struct timeval *timeout)
+{
+    struct event_main *event_main = queue->event_main;
+    struct event_task *task = event_main->task;
+    int res;
+
+    if (!task) {
+        log_fatal("waiting on queue[%p] without task; main() should be in event_main() now...", queue);
+        return -1;
+    }
+
+    if (timeout) {
+        task->wait_timer.func = event_queue_timeout;
+        task->wait_timer.ctx = task;
+
+        event_main_timestamp(event_main, &task->wait_timer.timeout, timeout);
+
+        if (event_timer_arm(event_main, &task->wait_timer)) {
+            log_error("event_timer_arm");
+            return -1;
+        }
+    }
+
+    task->queue = queue;
+
+    TAILQ_INSERT_TAIL(&queue->tasks, task, event_waits);
+
+    log_debug("<- %s[%p] queue[%p]", task->name, task, queue);
+
+    // the queue may be destroyed once we are woken up
+    event_context_resume(&task->context);
+
+    res = task->wait_res;
+
+    log_debug("-> %s[%p] %d", task->name, task, res);
+
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+
+    return res;
+}
+
+int event_queue_wake (struct event_queue *queue)
+{
+    struct event_task *task;
+
+    if (!(task = TAILQ_FIRST(&queue->tasks)))
+        return 0;
+
+    event_queue_remove(queue, task, 0);
+    event_schedule(queue->event_main, task);
+
+    return 1;
+}
+
+int event_queue_wake_all (struct event_queue *queue)
+{
+    int count = 0;
+
+    while (event_queue_wake(queue))
+        count++;
+
+    return count;
+}
+
+void event_queue_destroy (struct event_queue *queue)
+{
+    struct event_task *task;
+
+    while ((task = TAILQ_FIRST(&queue->tasks))) {
+        log_warning("%s[%p] still waiting on queue[%p]", task->name, task, queue);
+
+        event_queue_remove(queue, task, -EPIPE);
+        event_schedule(queue->event_main, task);
+    }
+
+    free(queue);
+}
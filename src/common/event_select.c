@@ -0,0 +1,103 @@
+#include "common/event_internal.h"
+
+#include "common/log.h"
+
+#include <assert.h>
+#include <sys/select.h>
+
+/*
+ * Portable select() backend.
+ *
+ * The set of fds to select on is re-built from the events list on each iteration.
+ */
+static int event_select_create (struct event_main *event_main)
+{
+    return 0;
+}
+
+static int event_select_max (struct event_main *event_main)
+{
+    return FD_SETSIZE;
+}
+
+static int event_select_add (struct event_main *event_main, struct event *event)
+{
+    return 0;
+}
+
+static void event_select_del (struct event_main *event_main, struct event *event)
+{
+    event->backend_flags = 0;
+}
+
+static int event_select_wait (struct event_main *event_main, const struct timeval *timeout)
+{
+    fd_set read, write;
+    struct timeval select_timeout;
+    struct event *event;
+    int nfds = 0, ret;
+
+    FD_ZERO(&read);
+    FD_ZERO(&write);
+
+    TAILQ_FOREACH(event, &event_main->events, event_main_events) {
+        if (event->destroy)
+            continue;
+
+        // select's FD_SET only supports fd's under a certain limit (e.g. 1k), larger ones invoke undefined behaviour.
+        assert(event->fd < FD_SETSIZE);
+
+        if (event->flags & EVENT_READ)
+            FD_SET(event->fd, &read);
+
+        if (event->flags & EVENT_WRITE)
+            FD_SET(event->fd, &write);
+
+        if ((event->flags & (EVENT_READ | EVENT_WRITE)) && event->fd >= nfds)
+            nfds = event->fd + 1;
+    }
+
+    // select() may modify the timeout
+    if (timeout)
+        select_timeout = *timeout;
+
+    if ((ret = select(nfds, &read, &write, NULL, timeout ? &select_timeout : NULL)) < 0) {
+        log_perror("select");
+        return -1;
+    }
+
+    event_main_wakeup(event_main, ret);
+
+    if (!ret)
+        return 0;
+
+    // event_destroy -safe loop, as destroyed events are only released once we return
+    TAILQ_FOREACH(event, &event_main->events, event_main_events) {
+        int flags = 0;
+
+        if (FD_ISSET(event->fd, &read) && (event->flags & EVENT_READ))
+            flags |= EVENT_READ;
+
+        if (FD_ISSET(event->fd, &write) && (event->flags & EVENT_WRITE))
+            flags |= EVENT_WRITE;
+
+        if (!flags) {
+            // maybe next time!
+            continue;
+        }
+
+        // this may event_destroy(event)
+        event_dispatch(event_main, event, flags);
+    }
+
+    return ret;
+}
+
+const struct event_backend event_select_backend = {
+    .name       = "select",
+    .create     = event_select_create,
+    .max        = event_select_max,
+    .add        = event_select_add,
+    .del        = event_select_del,
+    .wait       = event_select_wait,
+};
@@ -0,0 +1,496 @@
+#include "common/event_internal.h"
+
+#include "common/log.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Number of submission queue entries; the completion queue is twice as large.
+ */
+#define EVENT_URING_ENTRIES 1024
+
+/*
+ * The user_data for each submission refers to the event, tagged with the type of operation in the low bits.
+ */
+enum event_uring_tag {
+    EVENT_URING_POLL    = 0x0,
+    EVENT_URING_IO      = 0x1,
+    EVENT_URING_CANCEL  = 0x2,
+
+    EVENT_URING_TAG     = 0x3,
+};
+
+struct event_uring {
+    // submission queue ring
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+
+    // our own sq_tail, published for each queued entry
+    unsigned sq_queued;
+
+    // completion queue ring
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+};
+
+/*
+ * Linux io_uring() backend.
+ *
+ * Readiness is polled for using one-shot POLL_ADD operations, which are re-armed on the next event_register() after
+ * they complete. Tasks may also submit IO operations using event_io(), which complete without any further syscalls.
+ *
+ * All queued operations are only submitted to the kernel by event_uring_wait(), using a single io_uring_enter() that
+ * also waits for and reaps the completions in a batch.
+ */
+static int event_uring_setup (unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int event_uring_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static uint64_t event_uring_data (struct event *event, enum event_uring_tag tag)
+{
+    return (uintptr_t) event | tag;
+}
+
+static void event_uring_unmap (struct event_uring *uring)
+{
+    if (uring->sqes)
+        munmap(uring->sqes, uring->sqes_size);
+
+    if (uring->cq_map && uring->cq_map != uring->sq_map)
+        munmap(uring->cq_map, uring->cq_map_size);
+
+    if (uring->sq_map)
+        munmap(uring->sq_map, uring->sq_map_size);
+
+    free(uring);
+}
+
+static int event_uring_create (struct event_main *event_main)
+{
+    struct io_uring_params params = {
+        .flags      = IORING_SETUP_CLAMP | IORING_SETUP_COOP_TASKRUN,
+    };
+    struct event_uring *uring;
+
+    if ((event_main->fd = event_uring_setup(EVENT_URING_ENTRIES, &params)) < 0 && errno == EINVAL) {
+        // older kernel without COOP_TASKRUN
+        params = (struct io_uring_params) { .flags = IORING_SETUP_CLAMP };
+
+        event_main->fd = event_uring_setup(EVENT_URING_ENTRIES, &params);
+    }
+
+    if (event_main->fd < 0 && (errno == ENOSYS || errno == EPERM || errno == EINVAL)) {
+        // not supported, or disabled
+        return 1;
+
+    } else if (event_main->fd < 0) {
+        log_perror("io_uring_setup");
+        return -1;
+    }
+
+    // event_uring_mod() uses IORING_POLL_UPDATE_EVENTS from Linux 5.13, which has no feature flag of its own
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_RSRC_TAGS)) {
+        log_info("io_uring is missing required features: %#x", params.features);
+        close(event_main->fd);
+        return 1;
+    }
+
+    if (!(uring = calloc(1, sizeof(*uring)))) {
+        log_perror("calloc");
+        goto error;
+    }
+
+    uring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cq_map_size > uring->sq_map_size)
+            uring->sq_map_size = uring->cq_map_size;
+    }
+
+    if ((uring->sq_map = mmap(NULL, uring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, event_main->fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+        log_perror("mmap sq ring");
+        uring->sq_map = NULL;
+        goto error;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_map = uring->sq_map;
+
+    } else if ((uring->cq_map = mmap(NULL, uring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, event_main->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        log_perror("mmap cq ring");
+        uring->cq_map = NULL;
+        goto error;
+    }
+
+    if ((uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, event_main->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        log_perror("mmap sqes");
+        uring->sqes = NULL;
+        goto error;
+    }
+
+    uring->sq_head = uring->sq_map + params.sq_off.head;
+    uring->sq_tail = uring->sq_map + params.sq_off.tail;
+    uring->sq_mask = uring->sq_map + params.sq_off.ring_mask;
+    uring->sq_array = uring->sq_map + params.sq_off.array;
+    uring->sq_entries = params.sq_entries;
+    uring->sq_queued = *uring->sq_tail;
+
+    uring->cq_head = uring->cq_map + params.cq_off.head;
+    uring->cq_tail = uring->cq_map + params.cq_off.tail;
+    uring->cq_mask = uring->cq_map + params.cq_off.ring_mask;
+    uring->cqes = uring->cq_map + params.cq_off.cqes;
+
+    log_info("sq=%u cq=%u features=%#x", params.sq_entries, params.cq_entries, params.features);
+
+    event_main->backend_ctx = uring;
+
+    return 0;
+
+error:
+    if (uring)
+        event_uring_unmap(uring);
+
+    close(event_main->fd);
+
+    return -1;
+}
+
+static int event_uring_max (struct event_main *event_main)
+{
+    return 0;
+}
+
+/*
+ * Submit all queued entries, without waiting for any completions.
+ */
+static int event_uring_submit (struct event_main *event_main)
+{
+    struct event_uring *uring = event_main->backend_ctx;
+    unsigned to_submit = uring->sq_queued - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    int ret;
+
+    while ((ret = event_uring_enter(event_main->fd, to_submit, 0, 0, NULL, 0)) < 0 && errno == EINTR)
+        ;
+
+    if (ret < 0) {
+        log_perror("io_uring_enter %u", to_submit);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Queue a new submission entry, to be submitted on the next event_uring_wait().
+ */
+static struct io_uring_sqe *event_uring_sqe (struct event_main *event_main, uint8_t opcode, int fd, uint64_t user_data)
+{
+    struct event_uring *uring = event_main->backend_ctx;
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    if (uring->sq_queued - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+        log_debug("sq full");
+
+        if (event_uring_submit(event_main))
+            return NULL;
+    }
+
+    index = uring->sq_queued & *uring->sq_mask;
+    sqe = &uring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+
+    uring->sq_array[index] = index;
+
+    __atomic_store_n(uring->sq_tail, ++uring->sq_queued, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+static int event_uring_add (struct event_main *event_main, struct event *event)
+{
+    event->backend_flags = 0;
+
+    return 0;
+}
+
+static uint32_t event_uring_events (int flags)
+{
+    return (flags & EVENT_READ ? POLLIN : 0) | (flags & EVENT_WRITE ? POLLOUT : 0);
+}
+
+static int event_uring_mod (struct event_main *event_main, struct event *event, int flags)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!flags || flags == event->backend_flags) {
+        // lazily leave any pending poll as-is
+        return 0;
+
+    } else if (!event->backend_flags) {
+        if (!(sqe = event_uring_sqe(event_main, IORING_OP_POLL_ADD, event->fd, event_uring_data(event, EVENT_URING_POLL))))
+            return -1;
+
+        sqe->poll32_events = event_uring_events(flags);
+
+        event->backend_refs++;
+
+    } else {
+        // update the pending poll; this will fail if it has already completed, and we will re-arm it then
+        if (!(sqe = event_uring_sqe(event_main, IORING_OP_POLL_REMOVE, -1, event_uring_data(NULL, EVENT_URING_CANCEL))))
+            return -1;
+
+        sqe->addr = event_uring_data(event, EVENT_URING_POLL);
+        sqe->len = IORING_POLL_UPDATE_EVENTS;
+        sqe->poll32_events = event_uring_events(flags);
+    }
+
+    event->backend_flags = flags;
+
+    return 0;
+}
+
+static int event_uring_cancel (struct event_main *event_main, struct event *event)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = event_uring_sqe(event_main, IORING_OP_ASYNC_CANCEL, -1, event_uring_data(NULL, EVENT_URING_CANCEL))))
+        return -1;
+
+    sqe->addr = event_uring_data(event, EVENT_URING_IO);
+
+    return 0;
+}
+
+static void event_uring_del (struct event_main *event_main, struct event *event)
+{
+    struct io_uring_sqe *sqe;
+
+    if (event->backend_flags) {
+        if (!(sqe = event_uring_sqe(event_main, IORING_OP_POLL_REMOVE, -1, event_uring_data(NULL, EVENT_URING_CANCEL)))) {
+            log_warning("poll remove %d", event->fd);
+        } else {
+            sqe->addr = event_uring_data(event, EVENT_URING_POLL);
+        }
+    }
+
+    if (event->backend_refs > (event->backend_flags ? 1 : 0)) {
+        if (event_uring_cancel(event_main, event))
+            log_warning("cancel %d", event->fd);
+    }
+
+    event->backend_flags = 0;
+}
+
+static int event_uring_io (struct event_main *event_main, struct event *event, enum event_io_op op, void *buf, size_t size)
+{
+    uint64_t user_data = event_uring_data(event, EVENT_URING_IO);
+    struct io_uring_sqe *sqe;
+
+    switch (op) {
+        case EVENT_IO_READ:
+            if (!(sqe = event_uring_sqe(event_main, IORING_OP_RECV, event->fd, user_data)))
+                return -1;
+
+            sqe->addr = (uintptr_t) buf;
+            sqe->len = size;
+
+            break;
+
+        case EVENT_IO_WRITE:
+            if (!(sqe = event_uring_sqe(event_main, IORING_OP_SEND, event->fd, user_data)))
+                return -1;
+
+            sqe->addr = (uintptr_t) buf;
+            sqe->len = size;
+            sqe->msg_flags = MSG_NOSIGNAL;
+
+            break;
+
+        case EVENT_IO_ACCEPT:
+            if (!(sqe = event_uring_sqe(event_main, IORING_OP_ACCEPT, event->fd, user_data)))
+                return -1;
+
+            break;
+
+        case EVENT_IO_WRITEV:
+            if (!(sqe = event_uring_sqe(event_main, IORING_OP_SENDMSG, event->fd, user_data)))
+                return -1;
+
+            event->io_msg = (struct msghdr) {
+                .msg_iov    = buf,
+                .msg_iovlen = size,
+            };
+
+            sqe->addr = (uintptr_t) &event->io_msg;
+            sqe->msg_flags = MSG_NOSIGNAL;
+
+            break;
+
+        default:
+            log_fatal("unknown op %d", op);
+            return -1;
+    }
+
+    event->backend_refs++;
+
+    return 0;
+}
+
+/*
+ * Handle a completed poll.
+ */
+static void event_uring_poll (struct event_main *event_main, struct event *event, int res)
+{
+    int flags = 0;
+
+    event->backend_refs--;
+    event->backend_flags = 0;
+
+    if (res == -ECANCELED) {
+        return;
+
+    } else if (res < 0) {
+        // let the task find out what the error is
+        log_debug("%d[%p] poll: %s", event->fd, event, strerror(-res));
+
+        flags = EVENT_READ | EVENT_WRITE;
+
+    } else {
+        if (res & (POLLIN | POLLHUP | POLLERR))
+            flags |= EVENT_READ;
+
+        if (res & (POLLOUT | POLLHUP | POLLERR))
+            flags |= EVENT_WRITE;
+    }
+
+    if (event->destroy) {
+        return;
+
+    } else if (!(flags & event->flags)) {
+        // nobody is interested; re-arm for any task that is still waiting
+        if (event_uring_mod(event_main, event, event->flags & (EVENT_READ | EVENT_WRITE)))
+            log_warning("%d[%p] re-arm", event->fd, event);
+
+        return;
+    }
+
+    // this may event_destroy(event)
+    event_dispatch(event_main, event, flags & event->flags);
+}
+
+/*
+ * Handle a completed event_io().
+ */
+static void event_uring_complete (struct event_main *event_main, struct event *event, int res)
+{
+    event->backend_refs--;
+    event->io_res = res;
+
+    if (event->destroy) {
+        return;
+
+    } else if (!(event->flags & EVENT_IO)) {
+        log_warning("%d[%p] unexpected io completion: %d", event->fd, event, res);
+        return;
+    }
+
+    // this may event_destroy(event)
+    event_dispatch(event_main, event, EVENT_IO);
+}
+
+static int event_uring_wait (struct event_main *event_main, const struct timeval *timeout)
+{
+    struct event_uring *uring = event_main->backend_ctx;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = { };
+    unsigned to_submit = uring->sq_queued - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned head, tail;
+    int ret, count = 0;
+
+    if (timeout) {
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_usec * 1000;
+
+        arg.ts = (uintptr_t) &ts;
+    }
+
+    // submit and wait in one go, reaping any completions even on timeout
+    ret = event_uring_enter(event_main->fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+    if (ret < 0 && errno != ETIME && errno != EINTR) {
+        log_perror("io_uring_enter %u", to_submit);
+        return -1;
+    }
+
+    head = *uring->cq_head;
+    tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+    event_main_wakeup(event_main, tail - head);
+
+    // the events remain valid until we return, even if they are event_destroy()'d
+    for (; head != tail; head++, count++) {
+        struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        struct event *event = (struct event *) (uintptr_t) (user_data & ~(uint64_t) EVENT_URING_TAG);
+
+        // release the entry before dispatching, as the task may queue new entries
+        __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        switch (user_data & EVENT_URING_TAG) {
+            case EVENT_URING_POLL:
+                event_uring_poll(event_main, event, res);
+                break;
+
+            case EVENT_URING_IO:
+                event_uring_complete(event_main, event, res);
+                break;
+
+            case EVENT_URING_CANCEL:
+                if (res < 0 && res != -ENOENT && res != -EALREADY)
+                    log_debug("cancel: %s", strerror(-res));
+                break;
+        }
+    }
+
+    return count;
+}
+
+const struct event_backend event_uring_backend = {
+    .name       = "io_uring",
+    .create     = event_uring_create,
+    .max        = event_uring_max,
+    .add        = event_uring_add,
+    .mod        = event_uring_mod,
+    .del        = event_uring_del,
+    .io         = event_uring_io,
+    .cancel     = event_uring_cancel,
+    .wait       = event_uring_wait,
+};
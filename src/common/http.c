@@ -5,13 +5,16 @@
 
 #include "common/log.h"
 #include "common/parse.h"
+#include "common/scan.h"
 #include "common/util.h"
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 struct http {
     /* Stream IO */
@@ -36,14 +39,57 @@ const char * http_status_str (enum http_status status)
         case 413:   return "Request Entity Too Large";
         case 414:   return "Request-URI Too Long";
         case 415:   return "Unsupported Media Type";
+        case 431:   return "Request Header Fields Too Large";
 
         case 500:    return "Internal Server Error";
+        case 501:   return "Not Implemented";
 
         // hrhr
         default:    return "Unknown Response Status";
     }
 }
 
+/*
+ * Perfect hash of the well-known header names, using the length and case-folded first char.
+ */
+#define HTTP_HEADER_HASH(len, c) (((len) + ((c) | 0x20)) & 15)
+
+static const struct http_header_name {
+    const char *name;
+    size_t len;
+    enum http_header_id id;
+} http_header_names[16] = {
+    [HTTP_HEADER_HASH(4,  'h')] = { "Host",               4,  HTTP_HEADER_HOST              },
+    [HTTP_HEADER_HASH(14, 'c')] = { "Content-Length",     14, HTTP_HEADER_CONTENT_LENGTH    },
+    [HTTP_HEADER_HASH(10, 'c')] = { "Connection",         10, HTTP_HEADER_CONNECTION        },
+    [HTTP_HEADER_HASH(12, 'c')] = { "Content-Type",       12, HTTP_HEADER_CONTENT_TYPE      },
+    [HTTP_HEADER_HASH(17, 't')] = { "Transfer-Encoding",  17, HTTP_HEADER_TRANSFER_ENCODING },
+    [HTTP_HEADER_HASH(13, 'i')] = { "If-None-Match",      13, HTTP_HEADER_IF_NONE_MATCH     },
+    [HTTP_HEADER_HASH(5,  'r')] = { "Range",              5,  HTTP_HEADER_RANGE             },
+};
+
+enum http_header_id http_header_lookup (const char *name, size_t len)
+{
+    const struct http_header_name *h;
+
+    if (!len)
+        return HTTP_HEADER_OTHER;
+
+    h = &http_header_names[HTTP_HEADER_HASH(len, name[0])];
+
+    if (h->len == len && strncasecmp(name, h->name, len) == 0)
+        return h->id;
+
+    return HTTP_HEADER_OTHER;
+}
+
+const char * http_head_get (const struct http_head *head, enum http_header_id id)
+{
+    const struct http_header *header = head->known[id];
+
+    return header ? header->value : NULL;
+}
+
 int http_create (struct http **httpp, struct stream *read, struct stream *write)
 {
     struct http *http = NULL;
@@ -138,37 +184,39 @@ static int http_read_line (struct http *http, char **linep)
 
 int http_parse_header (char *line, const char **headerp, const char **valuep)
 {
-    enum state { START, HEADER, SEP_PRE, SEP, SEP_POST, VALUE, END, FOLD_VALUE };
-    struct parse parsing[] = {
-        { START,        ' ',    FOLD_VALUE    },
-        { START,        '\t',    FOLD_VALUE    },
-        { START,        -1,        HEADER,        PARSE_KEEP        },
+    char *end, *c;
 
-        { HEADER,        ' ',    SEP,        PARSE_STRING,    .parse_string = headerp        },
-        { HEADER,        '\t',    SEP,        PARSE_STRING,    .parse_string = headerp        },
-        { HEADER,        ':',    SEP_POST,    PARSE_STRING,    .parse_string = headerp        },
-        
-        { SEP,            ' ',    SEP            },
-        { SEP,            '\t',    SEP            },
-        { SEP,            ':',    SEP_POST    },
+    if (*line == ' ' || *line == '\t') {
+        // folded value, leaving headerp as-is
+        for (c = line; *c == ' ' || *c == '\t'; c++)
+            ;
 
-        { SEP_POST,        ' ',    SEP_POST    },
-        { SEP_POST,        '\t',    SEP_POST    },
-        { SEP_POST,        -1,        VALUE,        PARSE_KEEP         },
-        
-        { VALUE,        0,        END,        PARSE_STRING,    .parse_string = valuep        },
-        
-        /*For folded headers, we leave headerp as-is. */
-        { FOLD_VALUE,    ' ',    FOLD_VALUE    },
-        { FOLD_VALUE,    0,        END,        PARSE_STRING,    .parse_string = valuep        },
+        *valuep = c;
 
-        { }
-    };
-    int err;
+        return 0;
+    }
 
-    // parse
-    if ((err = parse(parsing, line, START)) != END)
+    // header name, immediately followed by the separator, without any whitespace (RFC 7230 3.2.4)
+    end = scan_str(line, ':', ' ', '\t');
+
+    if (*end != ':' || end == line) {
+        log_debug("invalid header name: %s", line);
         return 400;
+    }
+
+    *end = '\0';
+    *headerp = line;
+
+    // value
+    for (c = end + 1; *c == ' ' || *c == '\t'; c++)
+        ;
+
+    if (!*c) {
+        log_debug("empty value: %s", line);
+        return 400;
+    }
+
+    *valuep = c;
 
     return 0;
 }
@@ -282,17 +330,24 @@ int http_write_file (struct http *http, int fd, size_t content_length)
 // 3.6.1 Chunked Transfer Coding
 int http_write_chunk (struct http *http, const char *buf, size_t size)
 {
-    int err;
+    char head[32];
+    int len, err;
 
     log_debug("%zu", size);
 
-    if ((err = http_writef(http, "%zx\r\n", size)))
-        return err;
+    if ((len = snprintf(head, sizeof(head), "%zx\r\n", size)) < 0) {
+        log_perror("snprintf");
+        return -1;
+    }
 
-    if ((err = stream_write(http->write, buf, size)))
-        return err;
+    // chunk header, data and trailer
+    struct iovec iov[] = {
+        { .iov_base = head,             .iov_len = len  },
+        { .iov_base = (char *) buf,     .iov_len = size },
+        { .iov_base = (char *) "\r\n",  .iov_len = 2    },
+    };
 
-    if ((err = http_writef(http, "\r\n")))
+    if ((err = stream_writev(http->write, iov, 3)))
         return err;
 
     return 0;
@@ -361,24 +416,32 @@ int http_write_chunks (struct http *http)
     return http_writef(http, "0\r\n\r\n");
 }
 
+int http_flush (struct http *http)
+{
+    return stream_flush(http->write);
+}
+
 int http_parse_request (char *line, const char **methodp, const char **pathp, const char **versionp)
 {
-    enum state { START, METHOD, PATH, VERSION, END };
-    struct parse parsing[] = {
-        { START,     ' ',     -1            },
-        { START,    -1,        METHOD,        PARSE_KEEP         },
+    char *path, *version;
 
-        { METHOD,    ' ',    PATH,        PARSE_STRING,    .parse_string = methodp        },
-        { PATH,        ' ',     VERSION,    PARSE_STRING,    .parse_string = pathp        },
-        { VERSION,    '\0',    END,        PARSE_STRING,    .parse_string = versionp    },
-        { }
-    };
-    int err;
+    if (!*line || *line == ' ')
+        return 400;
 
-    // parse
-    if ((err = parse(parsing, line, START)) != END)
+    if (!*(path = scan_str(line, ' ', ' ', ' ')))
+        return 400;
+
+    *path++ = '\0';
+
+    if (!*(version = scan_str(path, ' ', ' ', ' ')))
         return 400;
 
+    *version++ = '\0';
+
+    *methodp = line;
+    *pathp = path;
+    *versionp = version;
+
     return 0;
 }
 
@@ -421,6 +484,95 @@ int http_read_request (struct http *http, const char **methodp, const char **pat
     return 0;
 }
 
+int http_parse_head (char *buf, size_t size, struct http_head *head)
+{
+    char *line, *nl, *end = buf + size;
+    char *fold = NULL;
+    struct http_header *header = NULL;
+    int err;
+
+    head->method = head->path = head->version = NULL;
+    head->count = 0;
+    memset(head->known, 0, sizeof(head->known));
+
+    for (line = buf; line < end && (nl = scan_mem(line, end, '\n', '\n')) < end; line = nl + 1) {
+        char *eol = (nl > line && nl[-1] == '\r') ? nl - 1 : nl;
+
+        *eol = '\0';
+
+        if (line == buf) {
+            if ((err = http_parse_request(line, &head->method, &head->path, &head->version))) {
+                log_warning("http_parse_request");
+                return err;
+            }
+
+            continue;
+        }
+
+        if (eol == line) {
+            // end of headers
+            return 0;
+        }
+
+        if (*line == ' ' || *line == '\t') {
+            if (!header) {
+                log_warning("folded line without header: %s", line);
+                return 400;
+            }
+
+            // join with the previous value, replacing its line terminator
+            for (; fold < line; fold++)
+                *fold = ' ';
+
+        } else if (head->count >= HTTP_HEADERS_MAX) {
+            log_warning("too many headers: %u", head->count);
+            return 431;
+
+        } else {
+            header = &head->headers[head->count];
+
+            if ((err = http_parse_header(line, &header->name, &header->value)))
+                return err;
+
+            header->id = http_header_lookup(header->name, strlen(header->name));
+
+            if (header->id && !head->known[header->id])
+                head->known[header->id] = header;
+
+            head->count++;
+        }
+
+        fold = eol;
+    }
+
+    log_warning("missing end of headers");
+    return 400;
+}
+
+int http_read_request_head (struct http *http, struct http_head *head)
+{
+    char *buf;
+    size_t size;
+    int err;
+
+    if ((err = stream_read_head(http->read, &buf, &size)))
+        return err;
+
+    log_debug("%zu", size);
+
+    return http_parse_head(buf, size, head);
+}
+
+bool http_read_pending (struct http *http)
+{
+    return stream_read_head_pending(http->read);
+}
+
+size_t http_read_buffered (struct http *http)
+{
+    return stream_read_buffered(http->read);
+}
+
 int http_read_response (struct http *http, const char **versionp, unsigned *statusp, const char **reasonp)
 {
     char *line;
@@ -508,6 +660,47 @@ int http_read_file (struct http *http, int fd, size_t content_length)
     return 0;
 }
 
+int http_parse_chunk_size (const char *line, size_t *sizep)
+{
+    const char *c;
+    size_t size = 0;
+    unsigned digit;
+
+    // 1*HEXDIG
+    for (c = line; ; c++) {
+        if (*c >= '0' && *c <= '9')
+            digit = *c - '0';
+        else if (*c >= 'a' && *c <= 'f')
+            digit = *c - 'a' + 10;
+        else if (*c >= 'A' && *c <= 'F')
+            digit = *c - 'A' + 10;
+        else
+            break;
+
+        if (size > SIZE_MAX >> 4) {
+            log_debug("chunk size overflow: %s", line);
+            return 400;
+        }
+
+        size = size << 4 | digit;
+    }
+
+    if (c == line) {
+        log_debug("missing chunk size: %s", line);
+        return 400;
+    }
+
+    // any chunk-ext is ignored
+    if (*c && *c != ';') {
+        log_debug("invalid chunk size: %s", line);
+        return 400;
+    }
+
+    *sizep = size;
+
+    return 0;
+}
+
 int http_read_chunk_header (struct http *http, size_t *sizep)
 {
     char *line;
@@ -517,9 +710,9 @@ int http_read_chunk_header (struct http *http, size_t *sizep)
     if ((err = http_read_line(http, &line)))
         return err;
 
-    if (sscanf(line, "%zx", sizep) != 1) {
-        log_perror("sscanf: %s", line);
-        return -1;
+    if (http_parse_chunk_size(line, sizep)) {
+        log_warning("invalid chunk size: %s", line);
+        return 400;
     }
 
     if (!*sizep) {
@@ -542,7 +735,7 @@ int http_read_chunk_footer (struct http *http)
 
     if (*line) {
         log_warning("trailing data after chunk");
-        return -1;
+        return 400;
     }
 
     return 0;
@@ -553,7 +746,7 @@ int http_read_chunk_footer (struct http *http)
  *
  * Note that this does not necessarily read in an entire chunk at a time, but will return partial chunks.
  *
- * Returns 0 on success with *sizep updated, 1 on end-of-chunks, -1 on error or invalid chunk.
+ * Returns 0 on success with *sizep updated, 1 on end-of-chunks, -1 on error, 400 on invalid chunk.
  */
 int http_read_chunked (struct http *http, char **bufp, size_t *sizep)
 {
@@ -639,6 +832,11 @@ int http_read_chunked_file (struct http *http, int fd)
             }
         }
 
+        if (err) {
+            log_warning("premature EOF: %zu", http->chunk_size);
+            return 1;
+        }
+
         // mark how much of the chunk we have consumed
         http->chunk_size -= size;
 
@@ -655,9 +853,8 @@ int http_read_chunked_file (struct http *http, int fd)
         }
     }
 
-    if (err < 0) {
-        // EOF
-        log_warning("http_read_chunked");
+    if (err != 1) {
+        log_warning("http_read_chunk_header");
         return err;
     }
 
@@ -3,6 +3,7 @@
 
 #include "common/stream.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 
@@ -22,6 +23,9 @@ struct http;
 /* Maximum Host: header length */
 #define HTTP_HOST_MAX 256
 
+/* Maximum number of request headers */
+#define HTTP_HEADERS_MAX 64
+
 enum http_version {
     HTTP_10         = 0,    // default
     HTTP_11,
@@ -39,9 +43,62 @@ enum http_status {
     HTTP_REQUEST_ENTITY_TOO_LARGE = 413,
     HTTP_REQUEST_URI_TOO_LONG   = 414,
     HTTP_UNSUPPORTED_MEDIA_TYPE = 415,
+    HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
     HTTP_INTERNAL_SERVER_ERROR    = 500,
+    HTTP_NOT_IMPLEMENTED        = 501,
+};
+
+/*
+ * Well-known headers, classified by http_header_lookup().
+ */
+enum http_header_id {
+    HTTP_HEADER_OTHER           = 0,
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_RANGE,
+
+    HTTP_HEADER_COUNT
+};
+
+/*
+ * One request header, as NUL-terminated strings pointing into the read stream's buffer.
+ */
+struct http_header {
+    enum http_header_id id;
+
+    const char *name;
+    const char *value;
 };
 
+/*
+ * A parsed request head, pointing into the read stream's buffer, valid until the next read from the http connection.
+ */
+struct http_head {
+    const char *method, *path, *version;
+
+    struct http_header headers[HTTP_HEADERS_MAX];
+    unsigned count;
+
+    /* The first header for each well-known id, or NULL */
+    const struct http_header *known[HTTP_HEADER_COUNT];
+};
+
+/*
+ * Classify the given header name, using a perfect hash of the well-known names.
+ *
+ * Returns HTTP_HEADER_OTHER for any other header.
+ */
+enum http_header_id http_header_lookup (const char *name, size_t len);
+
+/*
+ * Return the value of the first well-known header with the given id, or NULL if not present.
+ */
+const char * http_head_get (const struct http_head *head, enum http_header_id id);
+
 /*
  * Return a const char* with a textual reason for the given http status.
  */
@@ -57,7 +114,7 @@ int http_create (struct http **httpp, struct stream *read, struct stream *write)
 /*
  * Write data from memory, as part of the message body.
  *
- * XXX: ensure that the use of stream_write does not place limits on maximum length.
+ * All writes are buffered by the write stream, until it fills up, or http_flush() is called.
  */
 int http_write (struct http *http, const char *buf, size_t size);
 
@@ -120,6 +177,11 @@ int http_print_chunk (struct http *http, const char *fmt, ...)
  */
 int http_write_chunks (struct http *http);
 
+/*
+ * Write out any buffered request or response, e.g. once complete.
+ */
+int http_flush (struct http *http);
+
 
 
 
@@ -128,6 +190,25 @@ int http_write_chunks (struct http *http);
  */
 int http_read_request (struct http *http, const char **methodp, const char **pathp, const char **versionp);
 
+/*
+ * Read a full HTTP request head in a single pass, parsing the request line and headers in-place.
+ *
+ * Folded header values are joined in-place.
+ *
+ * Returns 1 on EOF, <0 on error, http 4xx on invalid request. The request line fields remain NULL if invalid.
+ */
+int http_read_request_head (struct http *http, struct http_head *head);
+
+/*
+ * Check if the next request head has already been received, e.g. from a pipelining client.
+ */
+bool http_read_pending (struct http *http);
+
+/*
+ * Return the amount of received data already buffered for reading, without blocking.
+ */
+size_t http_read_buffered (struct http *http);
+
 /*
  * Read a HTTP response.
  */
@@ -159,7 +240,9 @@ int http_read_string (struct http *http, char **bufp, size_t len);
 int http_read_file (struct http *http, int fd, size_t content_length);
 
 /*
- * Read response body chunks into FILE, or discard if -1
+ * Read chunked request or response body into FILE, or discard if -1, up to and including the end-of-chunks trailer.
+ *
+ * Returns 1 on (unexpected) EOF, <0 on error, 400 on invalid chunk.
  */
 int http_read_chunked_file (struct http *http, int fd);
 
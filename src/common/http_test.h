@@ -15,4 +15,16 @@ int http_parse_response (char *line, const char **versionp, unsigned *statusp, c
  */
 int http_parse_header (char *line, const char **headerp, const char **valuep);
 
+/*
+ * Parse request head from the given buffer, as returned by stream_read_head().
+ */
+int http_parse_head (char *buf, size_t size, struct http_head *head);
+
+/*
+ * Parse a chunk size from a chunk header line, ignoring any chunk extensions.
+ *
+ * Returns 400 on an invalid or overflowing size.
+ */
+int http_parse_chunk_size (const char *line, size_t *sizep);
+
 #endif
@@ -30,6 +30,9 @@ void _logv (const char *prefix, enum log_level level, int flags, const char *fmt
     if (level > _log_level)
         return;
     
+    // keep lines from separate threads whole
+    flockfile(log_file);
+
     if (!(flags & LOG_NOPRE))
         fprintf(log_file, "%-8s %30s: ", log_level_str(level), prefix);
 
@@ -42,6 +45,8 @@ void _logv (const char *prefix, enum log_level level, int flags, const char *fmt
         fprintf(log_file, "\n");
 
     fflush(log_file);
+
+    funlockfile(log_file);
 }
 
 void _log (const char *prefix, enum log_level level, int flags, const char *fmt, ...)
@@ -0,0 +1,131 @@
+#include "common/scan.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+static char * scan_mem_scalar (const char *p, const char *end, char a, char b)
+{
+    for (; p < end; p++) {
+        if (*p == a || *p == b)
+            break;
+    }
+
+    return (char *) p;
+}
+
+#ifdef SCAN_X86
+
+static char * scan_mem_sse2 (const char *p, const char *end, char a, char b)
+{
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+
+        if (mask)
+            return (char *) p + __builtin_ctz(mask);
+    }
+
+    return scan_mem_scalar(p, end, a, b);
+}
+
+static char * scan_str_sse2 (const char *str, char a, char b, char c)
+{
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), vc = _mm_set1_epi8(c), vz = _mm_setzero_si128();
+
+    // aligned loads never cross into the next page, so the leading bytes before str are masked off instead
+    unsigned offset = (uintptr_t) str & 15;
+    const char *p = str - offset;
+    unsigned mask = ~0u << offset;
+
+    for (;; p += 16, mask = ~0u) {
+        __m128i v = _mm_load_si128((const __m128i *) p);
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, vz))
+        );
+
+        if ((mask &= _mm_movemask_epi8(m)))
+            return (char *) p + __builtin_ctz(mask);
+    }
+}
+
+__attribute__((target("avx2")))
+static char * scan_mem_avx2 (const char *p, const char *end, char a, char b)
+{
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+
+        if (mask)
+            return (char *) p + __builtin_ctz(mask);
+    }
+
+    return scan_mem_sse2(p, end, a, b);
+}
+
+__attribute__((target("avx2")))
+static char * scan_str_avx2 (const char *str, char a, char b, char c)
+{
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b), vc = _mm256_set1_epi8(c), vz = _mm256_setzero_si256();
+
+    unsigned offset = (uintptr_t) str & 31;
+    const char *p = str - offset;
+    unsigned mask = ~0u << offset;
+
+    for (;; p += 32, mask = ~0u) {
+        __m256i v = _mm256_load_si256((const __m256i *) p);
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, vc), _mm256_cmpeq_epi8(v, vz))
+        );
+
+        if ((mask &= _mm256_movemask_epi8(m)))
+            return (char *) p + __builtin_ctz(mask);
+    }
+}
+
+#else
+
+static char * scan_str_scalar (const char *p, char a, char b, char c)
+{
+    for (; *p; p++) {
+        if (*p == a || *p == b || *p == c)
+            break;
+    }
+
+    return (char *) p;
+}
+
+#endif
+
+char * scan_mem (const char *buf, const char *end, char a, char b)
+{
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("avx2"))
+        return scan_mem_avx2(buf, end, a, b);
+    else
+        return scan_mem_sse2(buf, end, a, b);
+#else
+    return scan_mem_scalar(buf, end, a, b);
+#endif
+}
+
+char * scan_str (const char *str, char a, char b, char c)
+{
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("avx2"))
+        return scan_str_avx2(str, a, b, c);
+    else
+        return scan_str_sse2(str, a, b, c);
+#else
+    return scan_str_scalar(str, a, b, c);
+#endif
+}
@@ -0,0 +1,20 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+/*
+ * Vectorized scanning for delimiters, using AVX2 or SSE2 on x86_64 where supported, with a scalar fallback.
+ */
+
+/*
+ * Return a pointer to the first a or b within buf, before end, or end if there are none.
+ */
+char * scan_mem (const char *buf, const char *end, char a, char b);
+
+/*
+ * Return a pointer to the first a, b or c within the NUL-terminated str, or to the terminating NUL if there are none.
+ *
+ * This may read past the terminating NUL, but never past the aligned block containing it.
+ */
+char * scan_str (const char *str, char a, char b, char c);
+
+#endif
@@ -1,3 +1,6 @@
+// splice() and pipe2() with -gnu99
+#define _GNU_SOURCE
+
 #include "common/sock.h"
 
 #include "common/log.h"
@@ -9,6 +12,7 @@
 #include <stdio.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 int sockaddr_buf (char *buf, size_t buflen, const struct sockaddr *sa, socklen_t salen)
@@ -29,7 +33,7 @@ int sockaddr_buf (char *buf, size_t buflen, const struct sockaddr *sa, socklen_t
 
 const char *sockaddr_str (const struct sockaddr *sa, socklen_t salen)
 {
-    static char buf[SOCKADDR_MAX];
+    static __thread char buf[SOCKADDR_MAX];
 
     if (sockaddr_buf(buf, sizeof(buf), sa, salen)) {
         return NULL;
@@ -38,9 +42,44 @@ const char *sockaddr_str (const struct sockaddr *sa, socklen_t salen)
     return buf;
 }
 
+struct sock_resolve {
+    const char *host;
+    const char *port;
+    const struct addrinfo *hints;
+
+    struct addrinfo *addrs;
+    int err;
+};
+
+static void sock_resolve_offload (void *ctx)
+{
+    struct sock_resolve *resolve = ctx;
+
+    resolve->err = getaddrinfo(resolve->host, resolve->port, resolve->hints, &resolve->addrs);
+}
+
+int sock_resolve (struct event_main *event_main, struct addrinfo **addrsp, const char *host, const char *port, const struct addrinfo *hints)
+{
+    struct sock_resolve resolve = {
+        .host   = host,
+        .port   = port,
+        .hints  = hints,
+    };
+
+    if (event_offload(event_main, sock_resolve_offload, &resolve)) {
+        log_error("event_offload");
+        return EAI_SYSTEM;
+    }
+
+    if (!resolve.err)
+        *addrsp = resolve.addrs;
+
+    return resolve.err;
+}
+
 const char * sockname_str (int sock)
 {
-    static char buf[SOCKADDR_MAX];
+    static __thread char buf[SOCKADDR_MAX];
 
     struct sockaddr_storage addr;
     socklen_t addrlen = sizeof(addr);
@@ -59,7 +98,7 @@ const char * sockname_str (int sock)
 
 const char * sockpeer_str (int sock)
 {
-    static char buf[SOCKADDR_MAX];
+    static __thread char buf[SOCKADDR_MAX];
 
     struct sockaddr_storage addr;
     socklen_t addrlen = sizeof(addr);
@@ -145,6 +184,11 @@ int sock_accept (int ssock, int *sockp)
     } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
         return 1;
 
+    } else if (errno == ECONNABORTED || errno == EINTR) {
+        // try again with the next connection
+        log_pwarning("accept");
+        return 1;
+
     } else {
         log_perror("accept");
         return -1;
@@ -168,6 +212,22 @@ int sock_read (int sock, char *buf, size_t *sizep)
     }
 }
 
+int sock_peek (int sock)
+{
+    char c;
+
+    if (recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) >= 0) {
+        return 0;
+
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 1;
+
+    } else {
+        log_perror("recv");
+        return -1;
+    }
+}
+
 int sock_write (int sock, const char *buf, size_t *sizep)
 {
     int ret = write(sock, buf, *sizep);
@@ -185,6 +245,72 @@ int sock_write (int sock, const char *buf, size_t *sizep)
     }
 }
 
+int sock_writev (int sock, const struct iovec *iov, int iovcnt, size_t *sizep)
+{
+    ssize_t ret = writev(sock, iov, iovcnt);
+
+    if (ret >= 0) {
+        *sizep = ret;
+        return 0;
+
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 1;
+
+    } else {
+        log_perror("writev");
+        return -1;
+    }
+}
+
+int sock_splice (int sock, int pipe, size_t *sizep)
+{
+    ssize_t ret = splice(sock, NULL, pipe, NULL, *sizep, SPLICE_F_MOVE);
+
+    if (ret >= 0) {
+        *sizep = ret;
+        return 0;
+
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 1;
+
+    } else {
+        log_perror("splice");
+        return -1;
+    }
+}
+
+int sock_splice_file (int pipe, int fd, size_t size)
+{
+    ssize_t ret;
+
+    // the pipe holds exactly this much
+    while (size) {
+        if ((ret = splice(pipe, NULL, fd, NULL, size, SPLICE_F_MOVE)) < 0) {
+            log_perror("splice %d", fd);
+            return -1;
+        }
+
+        if (!ret) {
+            log_error("splice %d: eof", fd);
+            return -1;
+        }
+
+        size -= ret;
+    }
+
+    return 0;
+}
+
+int sock_pipe (int pipefd[2])
+{
+    if (pipe2(pipefd, O_CLOEXEC)) {
+        log_perror("pipe2");
+        return -1;
+    }
+
+    return 0;
+}
+
 int sock_sendfile (int sock, int fd, size_t *sizep)
 {
     int ret = sendfile(sock, fd, NULL, *sizep);
@@ -1,7 +1,11 @@
 #ifndef SOCK_H
 #define SOCK_H
 
+#include "common/event.h"
+
+#include <netdb.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #define SOCKADDR_MAX 1024
 
@@ -25,6 +29,15 @@ const char * sockname_str (int sock);
  */
 const char * sockpeer_str (int sock);
 
+/*
+ * Resolve the given host/port using getaddrinfo(), using event_offload() to avoid blocking the event_main.
+ *
+ * The returned *addrsp must be freeaddrinfo()'d.
+ *
+ * Returns 0 on success, or an EAI_* error for gai_strerror().
+ */
+int sock_resolve (struct event_main *event_main, struct addrinfo **addrsp, const char *host, const char *port, const struct addrinfo *hints);
+
 /*
  * Make socket nonblocking
  */
@@ -47,7 +60,7 @@ int sock_error (int sock);
 /*
  * Accept a new socket connection on a listen() socket.
  *
- * Returns 1 on nonblocking, 0 on success, <0 on error.
+ * Returns 1 if there is no connection to accept, or it was aborted, 0 on success, <0 on error.
  */
 int sock_accept (int ssock, int *sockp);
 
@@ -60,6 +73,13 @@ int sock_accept (int ssock, int *sockp);
  */
 int sock_read (int sock, char *buf, size_t *sizep);
 
+/*
+ * Check if the socket has anything to read, or EOF, without consuming it.
+ *
+ * Returns 1 on nonblocking, 0 if readable, <0 on error.
+ */
+int sock_peek (int sock);
+
 /*
  * Write to a socket.
  *
@@ -69,6 +89,36 @@ int sock_read (int sock, char *buf, size_t *sizep);
  */
 int sock_write (int sock, const char *buf, size_t *sizep);
 
+/*
+ * Write to a socket from multiple buffers, returning the total number of bytes written in *sizep.
+ *
+ * Returns *sizep == 0 on EOF.
+ *
+ * Returns 1 on nonblocking, 0 on success, <0 on error.
+ */
+int sock_writev (int sock, const struct iovec *iov, int iovcnt, size_t *sizep);
+
+/*
+ * Create a pipe for use with sock_splice().
+ */
+int sock_pipe (int pipefd[2]);
+
+/*
+ * Move data from the socket into the given pipe, without copying it through userspace.
+ *
+ * Returns *sizep == 0 on EOF.
+ *
+ * Returns 1 on nonblocking, 0 on success, <0 on error.
+ */
+int sock_splice (int sock, int pipe, size_t *sizep);
+
+/*
+ * Move the given amount of data out of the pipe into the file, blocking until all of it has been written.
+ *
+ * Returns 0 on success, <0 on error.
+ */
+int sock_splice_file (int pipe, int fd, size_t size);
+
 /*
  * Copy from file to socket.
  *
@@ -17,12 +17,18 @@
 
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <string.h>
 #include <unistd.h>
 
 #ifndef WITH_SSL
 #error XXX: building common/ssl.o without WITH_SSL
 #endif
 
+/*
+ * Buffer used to coalesce ssl_stream_writev(), up to the maximum TLS record size.
+ */
+#define SSL_WRITEV_SIZE 16384
+
 struct ssl_main {
     SSL_CTX *ssl_ctx;
 };
@@ -117,9 +123,34 @@ int ssl_stream_write (const char *buf, size_t *sizep, void *ctx)
     return 0;
 }
 
+/*
+ * There is no SSL_writev(), so coalesce the buffers into a single record where they fit.
+ */
+int ssl_stream_writev (const struct iovec *iov, int iovcnt, size_t *sizep, void *ctx)
+{
+    char buf[SSL_WRITEV_SIZE];
+    size_t size = 0;
+
+    if (iov[0].iov_len >= sizeof(buf)) {
+        *sizep = iov[0].iov_len;
+
+        return ssl_stream_write(iov[0].iov_base, sizep, ctx);
+    }
+
+    for (int i = 0; i < iovcnt && size + iov[i].iov_len <= sizeof(buf); i++) {
+        memcpy(buf + size, iov[i].iov_base, iov[i].iov_len);
+        size += iov[i].iov_len;
+    }
+
+    *sizep = size;
+
+    return ssl_stream_write(buf, sizep, ctx);
+}
+
 struct stream_type ssl_stream_type = {
     .read   = ssl_stream_read,
     .write  = ssl_stream_write,
+    .writev = ssl_stream_writev,
 };
 
 int ssl_connect (struct ssl *ssl, const char *host, const char *port)
@@ -200,7 +231,7 @@ int ssl_client (struct ssl_main *ssl_main, struct ssl **sslp, const char *host,
     if ((err = ssl_connect(ssl, host, port)))
         goto error;
 
-    if ((err = stream_create(&ssl_stream_type, &ssl->read, SSL_STREAM_SIZE, ssl))) {
+    if ((err = stream_create_ring(&ssl_stream_type, &ssl->read, NULL, SSL_STREAM_SIZE, EVENT_BUF_SIZE, ssl))) {
         log_error("stream_create read");
         goto error;
     }
@@ -1,11 +1,17 @@
 #include "common/stream.h"
 
 #include "common/log.h"
+#include "common/scan.h"
 
+#include <errno.h>
+#include <linux/memfd.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 /*
@@ -21,7 +27,10 @@ static inline char * stream_readbuf_ptr (struct stream *stream)
  */
 static inline size_t stream_readbuf_size (struct stream *stream)
 {
-    return stream->size - stream->length;
+    if (stream->ring)
+        return stream->size - (stream->length - stream->offset);
+    else
+        return stream->size - stream->length;
 }
 
 /*
@@ -65,6 +74,163 @@ static int stream_init (const struct stream_type *type, struct stream *stream, s
     return 0;
 }
 
+/*
+ * Map a memfd of the given size twice back-to-back.
+ *
+ * Returns 1 if not supported, or out of mappings.
+ */
+static int stream_map_ring (char **bufp, size_t size)
+{
+    char *map = MAP_FAILED;
+    int fd, err = -1;
+
+    if ((fd = syscall(SYS_memfd_create, "stream", MFD_CLOEXEC)) < 0 && errno == ENOSYS) {
+        log_debug("memfd_create: not supported");
+        return 1;
+
+    } else if (fd < 0) {
+        log_perror("memfd_create");
+        return -1;
+    }
+
+    if (ftruncate(fd, size)) {
+        log_perror("ftruncate %zu", size);
+        goto error;
+    }
+
+    // reserve contiguous address space for both mappings
+    if ((map = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        log_perror("mmap %zu", size * 2);
+        goto error;
+    }
+
+    // each ring uses two mappings, which may run into the vm.max_map_count limit before any memory limit
+    if (mmap(map, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(map + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+    ) {
+        if (errno == ENOMEM) {
+            log_pwarning("mmap %zu: falling back", size);
+            err = 1;
+        } else {
+            log_perror("mmap %zu", size);
+        }
+
+        goto error;
+    }
+
+    // the mappings keep the memory
+    close(fd);
+
+    *bufp = map;
+
+    return 0;
+
+error:
+    if (map != MAP_FAILED)
+        munmap(map, size * 2);
+
+    close(fd);
+
+    return err;
+}
+
+/*
+ * Allocate a new growable buffer of the given size, using a pooled or new ring if possible.
+ */
+static int stream_alloc (struct stream *stream, size_t size, char **bufp, bool *ringp)
+{
+    int err;
+
+    if (stream->event_main && (*bufp = event_main_buf_get(stream->event_main, size))) {
+        *ringp = true;
+        return 0;
+    }
+
+    if ((err = stream_map_ring(bufp, size)) < 0)
+        return err;
+
+    if (!err) {
+        *ringp = true;
+        return 0;
+    }
+
+    if (!(*bufp = malloc(size))) {
+        log_perror("malloc %zu", size);
+        return -1;
+    }
+
+    *ringp = false;
+
+    return 0;
+}
+
+/*
+ * Release the current buffer, returning it to the pool if possible.
+ */
+static void stream_free (struct stream *stream)
+{
+    if (!stream->ring) {
+        free(stream->buf);
+
+    } else if (!stream->event_main || event_main_buf_put(stream->event_main, stream->buf, stream->size)) {
+        munmap(stream->buf, stream->size * 2);
+    }
+
+    stream->buf = NULL;
+}
+
+/*
+ * Take a new buffer for a released stream.
+ */
+static int stream_acquire (struct stream *stream)
+{
+    if (stream->buf)
+        return 0;
+
+    return stream_alloc(stream, stream->size, &stream->buf, &stream->ring);
+}
+
+/*
+ * Move the buffered data into a buffer twice the size, once full.
+ *
+ * Returns 1 if the buffer is already at its maximum size.
+ */
+static int stream_grow (struct stream *stream)
+{
+    size_t length = stream->length - stream->offset, size = stream->size * 2;
+    char *buf;
+    bool ring;
+    int err;
+
+    if (!stream->max || stream->size >= stream->max)
+        return 1;
+
+    if ((err = stream_alloc(stream, size, &buf, &ring)))
+        return err;
+
+    memcpy(buf, stream->buf + stream->offset, length);
+
+    log_debug("%zu -> %zu with %zu bytes", stream->size, size, length);
+
+    stream_free(stream);
+
+    stream->buf = buf;
+    stream->size = size;
+    stream->offset = 0;
+    stream->length = length;
+    stream->ring = ring;
+
+    return 0;
+}
+
+/*
+ * The buffer is full of unconsumed data, and cannot grow any further.
+ */
+static bool stream_full (struct stream *stream)
+{
+    return stream->buf && !stream_readbuf_size(stream) && (!stream->max || stream->size >= stream->max);
+}
+
 int stream_create (const struct stream_type *type, struct stream **streamp, size_t size, void *ctx)
 {
     struct stream *stream;
@@ -85,6 +251,32 @@ error:
     return -1;
 }
 
+int stream_create_ring (const struct stream_type *type, struct stream **streamp, struct event_main *event_main, size_t size, size_t max, void *ctx)
+{
+    struct stream *stream;
+    size_t min = sysconf(_SC_PAGESIZE);
+
+    if (!(stream = calloc(1, sizeof(*stream)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    while (min < size)
+        min *= 2;
+
+    // allocated on first use
+    stream->type = type;
+    stream->buf = NULL;
+    stream->size = min;
+    stream->min = min;
+    stream->max = max;
+    stream->event_main = event_main;
+    stream->ctx = ctx;
+
+    *streamp = stream;
+    return 0;
+}
+
 /*
  * Mark given readbuf bytes as valid.
  */
@@ -101,6 +293,7 @@ inline static void stream_write_mark (struct stream *stream, size_t size)
 {
     // XXX: assert offset < length
     stream->offset += size;
+    stream->scan = 0;
 }
 
 /*
@@ -109,20 +302,49 @@ inline static void stream_write_mark (struct stream *stream, size_t size)
 inline static void stream_write_consume (struct stream *stream)
 {
     stream->offset = stream->length;
+    stream->scan = 0;
+}
+
+/*
+ * Restore the byte overwritten by a NUL terminator, before reading anything further from the stream.
+ */
+inline static void stream_restore (struct stream *stream)
+{
+    if (stream->restore) {
+        *stream_writebuf_ptr(stream) = stream->saved;
+        stream->restore = false;
+    }
 }
 
 /*
  * Clean out marked write buffer, making more room for the read buffer.
  *
- * Returns -1 if the stream buffer is full.
+ * Returns -1 if the stream buffer is full, and cannot grow.
  */
 int _stream_clear (struct stream *stream)
 {
-    if (!(stream->offset || stream->length < stream->size)) {
+    stream_restore(stream);
+
+    if (!stream->buf) {
+        // released
+        return 0;
+    }
+
+    if (stream->length - stream->offset >= stream->size && stream_grow(stream)) {
         log_warning("stream write buffer is full, no room for read");
         return -1;
     }
 
+    if (stream->ring) {
+        // the consumed space is already available for reading, just wrap the offsets back into the first mapping
+        if (stream->offset >= stream->size) {
+            stream->offset -= stream->size;
+            stream->length -= stream->size;
+        }
+
+        return 0;
+    }
+
     memmove(stream->buf, stream->buf + stream->offset, stream->length - stream->offset);
 
     stream->length -= stream->offset;
@@ -143,7 +365,22 @@ int _stream_clear (struct stream *stream)
 int _stream_read (struct stream *stream)
 {
     int err;
- 
+
+    if (!stream->buf) {
+        // wait for something to read before taking a buffer to read into
+        if (stream->type->poll && (err = stream->type->poll(stream->ctx))) {
+            log_debug("poll");
+            return -1;
+        }
+
+        if ((err = stream_acquire(stream)))
+            return err;
+
+    } else if (!stream_readbuf_size(stream) && stream_grow(stream)) {
+        log_warning("stream buffer is full at %zu bytes", stream->size);
+        return -1;
+    }
+
     // fill up
     size_t size = stream_readbuf_size(stream);
 
@@ -183,29 +420,25 @@ int _stream_append (struct stream *stream, char c)
 }
 
 /*
- * Insert one char into the stream.
+ * Terminate the string at the given offset with a NUL, saving the overwritten byte to be restored on the next read.
  */
-int _stream_insert (struct stream *stream, char c, size_t i)
+int _stream_terminate (struct stream *stream, size_t i)
 {
     if (i > stream_writebuf_size(stream)) {
-        log_debug("insert %zu out of bounds %zu", i, stream_writebuf_size(stream));
+        log_debug("terminate %zu out of bounds %zu", i, stream_writebuf_size(stream));
         return -1;
-    }
 
-    if (!stream_readbuf_size(stream)) {
-        log_debug("insert into full buffer");
+    } else if (i < stream_writebuf_size(stream)) {
+        stream->saved = *(stream_writebuf_ptr(stream) + i);
+        stream->restore = true;
+
+    } else if (!stream_readbuf_size(stream)) {
+        log_debug("terminate full buffer");
         return -1;
     }
-    
-    // shift one place right
-    memmove(stream_writebuf_ptr(stream) + i + 1, stream_writebuf_ptr(stream) + i, stream_writebuf_size(stream) - i);
-    
-    // insert
-    *(stream_writebuf_ptr(stream) + i) = c;
 
-    // mark
-    stream_read_mark(stream, 1);
-   
+    *(stream_writebuf_ptr(stream) + i) = '\0';
+
     return 0;
 }
 
@@ -290,8 +523,8 @@ int stream_read (struct stream *stream, char **bufp, size_t *sizep)
     if ((err = _stream_clear(stream)))
         return err;
 
-    // until we have the request amount of data, or any data, or EOF
-    while (stream->length < stream->offset + *sizep) {
+    // until we have the request amount of data, or any data, or EOF, or as much as fits into the buffer
+    while (stream->length < stream->offset + *sizep && !stream_full(stream)) {
         if ((err = _stream_read(stream)) < 0)
             return err;
         
@@ -313,7 +546,7 @@ int stream_read (struct stream *stream, char **bufp, size_t *sizep)
     }
 
     // consumed
-    stream->offset += *sizep;
+    stream_write_mark(stream, *sizep);
 
     return 0;
 }
@@ -328,16 +561,20 @@ int stream_read_line (struct stream *stream, char **linep)
         return err;
 
     while (true) {
-        // scan for \r\n
-        for (c = stream_writebuf_ptr(stream); c < stream_writebuf_end(stream); c++) {
+        char *end = stream_writebuf_end(stream);
+
+        // scan for \r\n, continuing from where we left off
+        for (c = stream_writebuf_ptr(stream) + stream->scan; (c = scan_mem(c, end, '\r', '\n')) < end; c++) {
             if (*c == '\r') {
                 *c = '\0';
-            } else if (*c == '\n') {
+            } else {
                 *c = '\0';
                 goto out;
             }
         }
 
+        stream->scan = stream_writebuf_size(stream);
+
         // needs moar bytez in mah buffers
         // XXX: should we return the last line on EOF, or expect a trailing \r\n?
         if ((err = _stream_read(stream)))
@@ -354,6 +591,72 @@ out:
     return 0;
 }
 
+/*
+ * Scan the buffered data for an empty line, continuing from where we left off.
+ *
+ * Returns a pointer to the \n ending the empty line, or NULL if not yet buffered.
+ */
+static char * stream_scan_head (struct stream *stream)
+{
+    char *start = stream_writebuf_ptr(stream), *end = stream_writebuf_end(stream), *c;
+
+    for (c = start + stream->scan; (c = scan_mem(c, end, '\n', '\n')) < end; c++) {
+        char *line = c;
+
+        if (line > start && line[-1] == '\r')
+            line--;
+
+        if (line == start || line[-1] == '\n')
+            return c;
+    }
+
+    stream->scan = stream_writebuf_size(stream);
+
+    return NULL;
+}
+
+int stream_read_head (struct stream *stream, char **bufp, size_t *sizep)
+{
+    char *start, *c;
+    int err;
+
+    // make room if needed
+    if ((err = _stream_clear(stream)))
+        return err;
+
+    while (!(c = stream_scan_head(stream))) {
+        if ((err = _stream_read(stream)))
+            return err;
+    }
+
+    start = stream_writebuf_ptr(stream);
+
+    *bufp = start;
+    *sizep = c - start + 1;
+
+    stream_write_mark(stream, *sizep);
+
+    return 0;
+}
+
+bool stream_read_head_pending (struct stream *stream)
+{
+    if (!stream->buf)
+        return false;
+
+    stream_restore(stream);
+
+    return stream_scan_head(stream) != NULL;
+}
+
+size_t stream_read_buffered (struct stream *stream)
+{
+    if (!stream->buf)
+        return 0;
+
+    return stream_writebuf_size(stream);
+}
+
 int stream_read_string (struct stream *stream, char **strp, size_t len)
 {
     int err;
@@ -366,14 +669,11 @@ int stream_read_string (struct stream *stream, char **strp, size_t len)
 
     // fill 'er up
     while (!len || stream_writebuf_size(stream) < len) {
-        // needs moar bytez in mah buffers
-        if (!stream_readbuf_size(stream)) {
-            log_debug("buffer became full while reading %zu of %zu", stream_writebuf_size(stream), len);
-            return -1;
-        }
-
-        if ((err = _stream_read(stream)) < 0)
+        // needs moar bytez in mah buffers, growing if full
+        if ((err = _stream_read(stream)) < 0) {
+            log_debug("failed while reading %zu of %zu", stream_writebuf_size(stream), len);
             return err;
+        }
 
         // handle EOF
         if (!err) {
@@ -394,10 +694,18 @@ int stream_read_string (struct stream *stream, char **strp, size_t len)
         }
     }
 
+    // room for the NUL
+    if (!len || stream_writebuf_size(stream) == len) {
+        if (!stream_readbuf_size(stream) && stream_grow(stream)) {
+            log_debug("stream writebuf became full when terminating with NUL");
+            return -1;
+        }
+    }
+
     // terminate with NUL
     if (len) {
-        if (_stream_insert(stream, '\0', len)) {
-            log_debug("stream writebuf became full when insrting NUL");
+        if (_stream_terminate(stream, len)) {
+            log_debug("stream writebuf became full when terminating with NUL");
             return -1;
         }
     } else {
@@ -412,16 +720,52 @@ int stream_read_string (struct stream *stream, char **strp, size_t len)
     log_debug("%s", *strp);
 
     // consume
-    stream_write_consume(stream);
+    if (len) {
+        stream_write_mark(stream, len);
+    } else {
+        stream_write_consume(stream);
+    }
 
     return 0;
 }
 
+/*
+ * Splice only into regular files, as e.g. terminals do not support it.
+ */
+static bool stream_splice_file (int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st)) {
+        log_pwarning("fstat %d", fd);
+        return false;
+    }
+
+    return S_ISREG(st.st_mode);
+}
+
 int stream_read_file (struct stream *stream, int fd, size_t *sizep)
 {
     int err;
     ssize_t ret;
 
+    stream_restore(stream);
+
+    if (!stream_writebuf_size(stream) && stream->type->splice && stream_splice_file(fd)) {
+        // any buffered data has been written out, move the rest directly
+        if ((err = stream->type->splice(fd, sizep, stream->ctx)) < 0) {
+            log_pwarning("stream-splice");
+            return err;
+        }
+
+        if (err && *sizep) {
+            log_debug("timeout");
+            return -1;
+        }
+
+        return err;
+    }
+
     // read() more if buffer empty; we should not block on read() while we still have data to process
     if (!stream_writebuf_size(stream)) {
         // make room if needed
@@ -465,11 +809,6 @@ int stream_read_file (struct stream *stream, int fd, size_t *sizep)
     return 0;
 }
 
-/*
- * Flush any pending writes.
- *
- * On success, the write buffer will be empty.
- */
 int stream_flush (struct stream *stream)
 {
     int err;
@@ -491,6 +830,24 @@ int stream_write (struct stream *stream, const char *buf, size_t size)
 {
     int err;
 
+    if ((err = stream_acquire(stream)))
+        return err;
+
+    if (size <= stream_readbuf_size(stream)) {
+        // buffer until full or flushed
+        memcpy(stream_readbuf_ptr(stream), buf, size);
+        stream_read_mark(stream, size);
+
+        return 0;
+    }
+
+    if (stream->type->writev) {
+        // write out together with the buffered data
+        struct iovec iov = { .iov_base = (char *) buf, .iov_len = size };
+
+        return stream_writev(stream, &iov, 1);
+    }
+
     // our write buffer must be empty, since _stream_write_direct will bypass it
     if ((err = stream_flush(stream)))
         return err;
@@ -498,26 +855,131 @@ int stream_write (struct stream *stream, const char *buf, size_t size)
     return _stream_write_direct(stream, buf, size);
 }
 
+int stream_writev (struct stream *stream, const struct iovec *iov, int iovcnt)
+{
+    struct iovec iovs[1 + STREAM_WRITEV_MAX], *v = iovs;
+    size_t buffered = stream_writebuf_size(stream), total = buffered;
+    int n = 0, err;
+
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    if (total - buffered <= stream_readbuf_size(stream) || !stream->type->writev || iovcnt > STREAM_WRITEV_MAX) {
+        // buffer until full or flushed, or write out separately
+        for (int i = 0; i < iovcnt; i++) {
+            if ((err = stream_write(stream, iov[i].iov_base, iov[i].iov_len)))
+                return err;
+        }
+
+        return 0;
+    }
+
+    // the buffered data goes first
+    if (buffered) {
+        iovs[n++] = (struct iovec) { .iov_base = stream_writebuf_ptr(stream), .iov_len = buffered };
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len)
+            iovs[n++] = iov[i];
+    }
+
+    while (n) {
+        size_t size = total;
+
+        if ((err = stream->type->writev(v, n, &size, stream->ctx)) < 0) {
+            log_pwarning("stream-writev");
+            return err;
+        }
+
+        if (!size) {
+            log_debug("eof");
+            return 1;
+        }
+
+        if (err) {
+            log_debug("timeout");
+            return -1;
+        }
+
+        total -= size;
+
+        // consume buffered data
+        if (buffered) {
+            size_t len = size < buffered ? size : buffered;
+
+            stream_write_mark(stream, len);
+            buffered -= len;
+        }
+
+        // skip written buffers, and advance into any partially written buffer
+        for (; n && size >= v->iov_len; v++, n--)
+            size -= v->iov_len;
+
+        if (n) {
+            v->iov_base = (char *) v->iov_base + size;
+            v->iov_len -= size;
+        }
+    }
+
+    // drop consumed data from write buffer
+    if ((err = _stream_clear(stream)) < 0)
+        return err;
+
+    return 0;
+}
+
 int stream_vprintf (struct stream *stream, const char *fmt, va_list args)
 {
+    va_list copy;
+    char *buf;
     int ret, err;
 
-    if ((ret = vsnprintf(stream_readbuf_ptr(stream), stream_readbuf_size(stream), fmt, args)) < 0) {
-        log_perror("snprintf");
+    if ((err = stream_acquire(stream)))
+        return err;
+
+    va_copy(copy, args);
+    ret = vsnprintf(stream_readbuf_ptr(stream), stream_readbuf_size(stream), fmt, copy);
+    va_end(copy);
+
+    if (ret < 0) {
+        log_perror("vsnprintf");
         return -1;
     }
     
-    if (ret >= stream_readbuf_size(stream))
-        // full
-        return 1;
-    
-    stream_read_mark(stream, ret);
-    
-    // TODO: write buffering
+    if (ret < stream_readbuf_size(stream)) {
+        // buffer until full or flushed
+        stream_read_mark(stream, ret);
+
+        return 0;
+    }
+
+    // make room in the buffer, and try again
     if ((err = stream_flush(stream)))
         return err;
 
-    return 0;
+    if (ret < stream_readbuf_size(stream)) {
+        vsnprintf(stream_readbuf_ptr(stream), stream_readbuf_size(stream), fmt, args);
+        stream_read_mark(stream, ret);
+
+        return 0;
+    }
+
+    // larger than the entire buffer
+    log_debug("%d > %zu", ret, stream_readbuf_size(stream));
+
+    if (!(buf = malloc(ret + 1))) {
+        log_perror("malloc %d", ret + 1);
+        return -1;
+    }
+
+    vsnprintf(buf, ret + 1, fmt, args);
+
+    err = _stream_write_direct(stream, buf, ret);
+
+    free(buf);
+
+    return err;
 }
 
 int stream_printf (struct stream *stream, const char *fmt, ...)
@@ -543,6 +1005,9 @@ int _stream_write_file (struct stream *stream, int fd, size_t *sizep)
     if ((err = _stream_clear(stream)))
         return err;
 
+    if ((err = stream_acquire(stream)))
+        return err;
+
     // read into readbuf
     size_t size = stream_readbuf_size(stream);
 
@@ -572,6 +1037,32 @@ int _stream_write_file (struct stream *stream, int fd, size_t *sizep)
     return 0;
 }
 
+/*
+ * Read a file into the write buffer, to be written out along with any other buffered data.
+ *
+ * There must be room for *sizep bytes in the buffer.
+ */
+static int _stream_buffer_file (struct stream *stream, int fd, size_t *sizep)
+{
+    ssize_t ret;
+
+    if ((ret = read(fd, stream_readbuf_ptr(stream), *sizep)) < 0) {
+        log_perror("read");
+        return -1;
+    }
+
+    if (!ret) {
+        log_debug("read: eof");
+        return 1;
+    }
+
+    stream_read_mark(stream, ret);
+
+    *sizep = ret;
+
+    return 0;
+}
+
 int stream_write_file (struct stream *stream, int fd, size_t *sizep)
 {
     int err;
@@ -580,6 +1071,13 @@ int stream_write_file (struct stream *stream, int fd, size_t *sizep)
         // fallback
         return _stream_write_file(stream, fd, sizep);
 
+    if ((err = stream_acquire(stream)))
+        return err;
+
+    // small files are buffered along with any preceding writes, rather than flushing them out separately
+    if (*sizep && *sizep <= stream_readbuf_size(stream))
+        return _stream_buffer_file(stream, fd, sizep);
+
     // our write buffer must be empty, since sendfile will bypass it
     if ((err = stream_flush(stream)))
         return err;
@@ -590,8 +1088,22 @@ int stream_write_file (struct stream *stream, int fd, size_t *sizep)
     return 0;
 }
 
+void stream_release (struct stream *stream)
+{
+    if (!stream->min || !stream->buf || stream->length > stream->offset)
+        return;
+
+    stream_free(stream);
+
+    stream->size = stream->min;
+    stream->offset = 0;
+    stream->length = 0;
+}
+
 void stream_destroy (struct stream *stream)
 {
-    free(stream->buf);
+    if (stream->buf)
+        stream_free(stream);
+
     free(stream);
 }
@@ -1,8 +1,12 @@
 #ifndef STREAM_H
 #define STREAM_H
 
+#include "common/event.h"
+
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <sys/uio.h>
 
 /*
  * Blocking SOCK_STREAM interface.
@@ -18,23 +22,57 @@ struct stream_type {
     int (*read)(char *buf, size_t *sizep, void *ctx);
     int (*write)(const char *buf, size_t *sizep, void *ctx);
     int (*sendfile)(int fd, size_t *sizep, void *ctx);
+
+    /* Optional: write from multiple buffers, returning the total amount written in *sizep */
+    int (*writev)(const struct iovec *iov, int iovcnt, size_t *sizep, void *ctx);
+
+    /* Optional: wait for something to read, before taking a released buffer to read into */
+    int (*poll)(void *ctx);
+
+    /* Optional: read directly into the given fd, bypassing the buffer */
+    int (*splice)(int fd, size_t *sizep, void *ctx);
 };
 
+/*
+ * Maximum number of buffers for stream_writev().
+ */
+#define STREAM_WRITEV_MAX 16
+
 struct stream {
     const struct stream_type *type;
 
+    /* NULL while released */
     char *buf;
 
-    // note that offset <= length <= size at all times
+    // note that offset <= length <= size at all times, unless ring
     /* The amount of leading data in the buffer that has already been consumed */
     size_t offset;
 
     /* The amount of valid data existing in the buffer */
     size_t length;
 
+    /* The amount of data after offset already scanned by stream_read_line() or stream_read_head() without finding the end */
+    size_t scan;
+
     /* The total length of the buffer */
     size_t size;
 
+    /* The initial and maximum size of a growable buffer, or zero for a fixed buffer */
+    size_t min, max;
+
+    /* Optional pool for growable buffers */
+    struct event_main *event_main;
+
+    /*
+     * The buffer is mapped twice back-to-back, such that offset < size and length <= offset + size instead, and the
+     * data is contiguous regardless of where it wraps around.
+     */
+    bool ring;
+
+    /* The byte at offset was overwritten by the NUL terminator for stream_read_string(), and is restored on the next read */
+    bool restore;
+    char saved;
+
     void *ctx;
 };
 
@@ -45,6 +83,16 @@ struct stream {
  */
 int stream_create (const struct stream_type *type, struct stream **streamp, size_t size, void *ctx);
 
+/*
+ * Construct a new stream using a ring buffer, such that reading never needs to move any buffered data.
+ *
+ * The buffer is only allocated once used, starting at the given size, and grows on demand up to max, rounded up to
+ * powers of two of the page size. Falls back to a plain malloc() buffer if not supported.
+ *
+ * If an event_main is given, the buffers are taken from its pool, and returned there once released.
+ */
+int stream_create_ring (const struct stream_type *type, struct stream **streamp, struct event_main *event_main, size_t size, size_t max, void *ctx);
+
 /*
  * Read binary data from the stream.
  *
@@ -63,17 +111,38 @@ int stream_read (struct stream *stream, char **bufp, size_t *sizep);
  */
 int stream_read_line (struct stream *stream, char **linep);
 
+/*
+ * Read a block of lines from the stream, up to and including the first empty line, such as a HTTP message head.
+ *
+ * The returned data is not NUL-terminated, and may be modified in-place. It remains valid until the next read.
+ *
+ * Returns 1 on EOF, <0 on error.
+ */
+int stream_read_head (struct stream *stream, char **bufp, size_t *sizep);
+
+/*
+ * Check if a complete head is already buffered, such that stream_read_head() will return it without reading.
+ */
+bool stream_read_head_pending (struct stream *stream);
+
+/*
+ * Return the amount of data already buffered for reading, which can be read without blocking.
+ */
+size_t stream_read_buffered (struct stream *stream);
+
 /*
  * Read stream as a string, returning a pointer to the NUL-terminated data.
  *
- * The maximum size to read should be given in len, or 0 to read to EOF.
+ * The maximum size to read should be given in len, or 0 to read to EOF. Any further data already read into the stream
+ * is kept for the next read.
  *
  * Returns 1 on EOF, <0 on error.
  */
 int stream_read_string (struct stream *stream, char **strp, size_t len);
 
 /*
- * Copy from stream into a FILE.
+ * Copy from stream into a FILE, bypassing the buffer once empty if the stream_type implements splice, and the fd is a
+ * regular file.
  *
  * *sizep is the number of bytes to read from stream, or zero to read until EOF.
  * *sizep is updated on return to reflect the amount of bytes copied, which may be less than *sizep.
@@ -83,18 +152,35 @@ int stream_read_string (struct stream *stream, char **strp, size_t len);
 int stream_read_file (struct stream *stream, int fd, size_t *sizep);
 
 /*
- * Write out the full contents of the given buffer to the stream.
+ * Write the full contents of the given buffer to the stream.
+ *
+ * Writes are buffered until the buffer fills up, or stream_flush() is called. Larger writes bypass the buffer.
  */
 int stream_write (struct stream *stream, const char *buf, size_t size);
 
 /*
- * Write arbitrary formatted output to the stream.
+ * Write the full contents of the given buffers to the stream, buffered like stream_write().
+ *
+ * If the stream_type implements writev, any buffered data and larger writes are written out together, in a single
+ * writev() where possible.
+ */
+int stream_writev (struct stream *stream, const struct iovec *iov, int iovcnt);
+
+/*
+ * Write arbitrary formatted output to the stream, buffered like stream_write().
  */
 int stream_vprintf (struct stream *stream, const char *fmt, va_list args);
 int stream_printf (struct stream *stream, const char *fmt, ...);
 
 /*
- * Copy to stream from a file, bypassing the buffer if the stream_type implements it.
+ * Write out any buffered data, before waiting to read a reply.
+ *
+ * On success, the write buffer will be empty.
+ */
+int stream_flush (struct stream *stream);
+
+/*
+ * Copy to stream from a file, bypassing the buffer if the stream_type implements it, unless small enough to buffer.
  *
  * *sizep is the number of bytes to be sent from fd, or zero to send until EOF.
  * *sizep is updated on return to reflect the amount of bytes copied, which may be less then *sizep.
@@ -103,6 +189,13 @@ int stream_printf (struct stream *stream, const char *fmt, ...);
  */
 int stream_write_file (struct stream *stream, int fd, size_t *sizep);
 
+/*
+ * Release the buffer while the stream is idle, if there is no buffered data, shrinking it back to its initial size.
+ *
+ * A new buffer is taken on the next read or write, once the stream_type's poll has anything to read.
+ */
+void stream_release (struct stream *stream);
+
 /*
  * Release all resources.
  */
@@ -15,10 +15,39 @@ const struct timeval * maybe_timeout (const struct timeval *timeout)
         return NULL;
 }
 
+/*
+ * Perform a read/write of the given size using event_io(), with the given idle timeout.
+ */
+static int tcp_stream_io (struct tcp *tcp, enum event_io_op op, void *buf, size_t size, size_t *sizep, const struct timeval *timeout)
+{
+    int err, ret;
+
+    if ((err = event_io(tcp->event, op, buf, size, maybe_timeout(timeout), &ret)) < 0) {
+        log_perror("event_io");
+        return -1;
+
+    } else if (err) {
+        log_error("event_io: timeout");
+        return err;
+    }
+
+    *sizep = ret;
+
+    if (!*sizep) {
+        log_debug("eof");
+        return 1;
+    }
+
+    return 0;
+}
+
 int tcp_stream_read (char *buf, size_t *sizep, void *ctx)
 {
     struct tcp *tcp = ctx;
     int err;
+
+    if (tcp->event && event_io_supported(tcp->event))
+        return tcp_stream_io(tcp, EVENT_IO_READ, buf, *sizep, sizep, &tcp->read_timeout);
     
     while ((err = sock_read(tcp->sock, buf, sizep)) > 0 && tcp->event) {
         if ((err = event_yield(tcp->event, EVENT_READ, maybe_timeout(&tcp->read_timeout)))) {
@@ -45,6 +74,9 @@ int tcp_stream_write (const char *buf, size_t *sizep, void *ctx)
     struct tcp *tcp = ctx;
     int err;
 
+    if (tcp->event && event_io_supported(tcp->event))
+        return tcp_stream_io(tcp, EVENT_IO_WRITE, (char *) buf, *sizep, sizep, &tcp->write_timeout);
+
     while ((err = sock_write(tcp->sock, buf, sizep)) > 0 && tcp->event) {
         if (event_yield(tcp->event, EVENT_WRITE, maybe_timeout(&tcp->write_timeout))) {
             log_error("event_yield");
@@ -65,6 +97,34 @@ int tcp_stream_write (const char *buf, size_t *sizep, void *ctx)
     return 0;
 }
 
+int tcp_stream_writev (const struct iovec *iov, int iovcnt, size_t *sizep, void *ctx)
+{
+    struct tcp *tcp = ctx;
+    int err;
+
+    if (tcp->event && event_io_supported(tcp->event))
+        return tcp_stream_io(tcp, EVENT_IO_WRITEV, (struct iovec *) iov, iovcnt, sizep, &tcp->write_timeout);
+
+    while ((err = sock_writev(tcp->sock, iov, iovcnt, sizep)) > 0 && tcp->event) {
+        if (event_yield(tcp->event, EVENT_WRITE, maybe_timeout(&tcp->write_timeout))) {
+            log_error("event_yield");
+            return err;
+        }
+    }
+
+    if (err) {
+        log_error("sock_writev");
+        return -1;
+    }
+
+    if (!*sizep) {
+        log_debug("eof");
+        return 1;
+    }
+
+    return 0;
+}
+
 int tcp_stream_sendfile (int fd, size_t *sizep, void *ctx)
 {
     struct tcp *tcp = ctx;
@@ -96,15 +156,81 @@ int tcp_stream_sendfile (int fd, size_t *sizep, void *ctx)
 
 }
 
+int tcp_stream_splice (int fd, size_t *sizep, void *ctx)
+{
+    struct tcp *tcp = ctx;
+    size_t size = (*sizep && *sizep < TCP_SPLICE_SIZE) ? *sizep : TCP_SPLICE_SIZE;
+    int err;
+
+    if (tcp->pipe[0] < 0 && sock_pipe(tcp->pipe)) {
+        log_error("sock_pipe");
+        return -1;
+    }
+
+    while ((err = sock_splice(tcp->sock, tcp->pipe[1], &size)) > 0 && tcp->event) {
+        if ((err = event_yield(tcp->event, EVENT_READ, maybe_timeout(&tcp->read_timeout)))) {
+            log_error("event_yield");
+            return err;
+        }
+    }
+
+    if (err) {
+        log_error("sock_splice");
+        return -1;
+    }
+
+    if (!size) {
+        log_debug("eof");
+        *sizep = 0;
+        return 1;
+    }
+
+    if (sock_splice_file(tcp->pipe[0], fd, size)) {
+        log_error("sock_splice_file");
+        return -1;
+    }
+
+    *sizep = size;
+
+    return 0;
+}
+
+int tcp_stream_poll (void *ctx)
+{
+    struct tcp *tcp = ctx;
+    int err;
+
+    if (!tcp->event)
+        return 0;
+
+    while ((err = sock_peek(tcp->sock)) > 0) {
+        if ((err = event_yield(tcp->event, EVENT_READ, maybe_timeout(&tcp->read_timeout)))) {
+            log_error("event_yield");
+            return err;
+        }
+    }
+
+    if (err) {
+        log_error("sock_peek");
+        return -1;
+    }
+
+    return 0;
+}
+
 static const struct stream_type tcp_stream_type = {
     .read       = tcp_stream_read,
     .write      = tcp_stream_write,
+    .writev     = tcp_stream_writev,
     .sendfile   = tcp_stream_sendfile,
+    .poll       = tcp_stream_poll,
+    .splice     = tcp_stream_splice,
 };
 
 int tcp_create (struct event_main *event_main, struct tcp **tcpp, int sock)
 {
     struct tcp *tcp = NULL;
+    size_t max = event_main ? event_main_buf_size(event_main) : EVENT_BUF_SIZE;
 
     if (!(tcp = calloc(1, sizeof(*tcp)))) {
         log_perror("calloc");
@@ -112,6 +238,7 @@ int tcp_create (struct event_main *event_main, struct tcp **tcpp, int sock)
     }
 
     tcp->sock = sock;
+    tcp->pipe[0] = tcp->pipe[1] = -1;
     
     if (event_main) {
         if (sock_nonblocking(sock)) {
@@ -125,12 +252,12 @@ int tcp_create (struct event_main *event_main, struct tcp **tcpp, int sock)
         }
     }
 
-    if (stream_create(&tcp_stream_type, &tcp->read, TCP_STREAM_SIZE, tcp)) {
+    if (stream_create_ring(&tcp_stream_type, &tcp->read, event_main, TCP_STREAM_SIZE, max, tcp)) {
         log_error("stream_create read");
         goto error;
     }
     
-    if (stream_create(&tcp_stream_type, &tcp->write, TCP_STREAM_SIZE, tcp)) {
+    if (stream_create_ring(&tcp_stream_type, &tcp->write, event_main, TCP_STREAM_SIZE, max, tcp)) {
         log_error("stream_create write");
         goto error;
     }
@@ -174,6 +301,12 @@ void tcp_write_timeout (struct tcp *tcp, const struct timeval *timeout)
     tcp->write_timeout = *timeout;
 }
 
+void tcp_release (struct tcp *tcp)
+{
+    stream_release(tcp->read);
+    stream_release(tcp->write);
+}
+
 void tcp_destroy (struct tcp *tcp)
 {
     if (tcp->event)
@@ -185,6 +318,11 @@ void tcp_destroy (struct tcp *tcp)
     if (tcp->read)
         stream_destroy(tcp->read);
 
+    if (tcp->pipe[0] >= 0) {
+        close(tcp->pipe[0]);
+        close(tcp->pipe[1]);
+    }
+
     if (tcp->sock >= 0)
         close(tcp->sock);
 
@@ -6,13 +6,21 @@
 /* This is a number with far too low a level of entropy to be used as a random number */
 #define TCP_LISTEN_BACKLOG 10
 
-// XXX: bad
+/* Initial size of the stream buffers, grown on demand up to the event_main_buf_size() */
 #define TCP_STREAM_SIZE 1024
 
+/* Maximum amount to splice at a time, within the default pipe capacity */
+#define TCP_SPLICE_SIZE 65536
+
 struct tcp;
 struct tcp_server;
 struct tcp_client;
 
+enum tcp_listen_flags {
+    /* Allow multiple sockets to listen on the same host/port, with the kernel distributing connections between them */
+    TCP_LISTEN_REUSEPORT    = 0x01,
+};
+
 typedef void (tcp_server_handler)(struct tcp_server *server, struct tcp *tcp, void *ctx);
 
 /*
@@ -20,7 +28,7 @@ typedef void (tcp_server_handler)(struct tcp_server *server, struct tcp *tcp, vo
  *
  * host may be given as NULL to listen on all addresses.
  */
-int tcp_listen (int *sockp, const char *host, const char *port, int backlog);
+int tcp_listen (int *sockp, const char *host, const char *port, int backlog, int flags);
 
 /*
  * Open a TCP client socket, connected to the given host/port.
@@ -31,8 +39,10 @@ int tcp_connect (struct event_main *event_main, int *sockp, const char *host, co
 
 /*
  * Run a server for accepting connections..
+ *
+ * flags:           some combination of enum tcp_listen_flags.
  */
-int tcp_server (struct event_main *event_main, struct tcp_server **serverp, const char *host, const char *port);
+int tcp_server (struct event_main *event_main, struct tcp_server **serverp, const char *host, const char *port, int flags);
 
 /*
  * Accept a new incoming request.
@@ -66,6 +76,11 @@ struct stream * tcp_write_stream (struct tcp *tcp);
 void tcp_read_timeout (struct tcp *tcp, const struct timeval *timeout);
 void tcp_write_timeout (struct tcp *tcp, const struct timeval *timeout);
 
+/*
+ * Release the stream buffers while idle, e.g. between requests, if there is no buffered data.
+ */
+void tcp_release (struct tcp *tcp);
+
 void tcp_destroy (struct tcp *tcp);
 
 #endif
@@ -76,7 +76,7 @@ int tcp_connect (struct event_main *event_main, int *sockp, const char *host, co
     };
     struct addrinfo *addrs, *addr;
 
-    if ((err = getaddrinfo(host, port, &hints, &addrs))) {
+    if ((err = sock_resolve(event_main, &addrs, host, port, &hints))) {
         log_perror("getaddrinfo %s:%s: %s", host, port, gai_strerror(err));
         return -1;
     }
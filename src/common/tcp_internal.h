@@ -12,6 +12,9 @@ struct tcp {
     struct timeval read_timeout, write_timeout;
 
     struct stream *read, *write;
+
+    // for splicing from the socket into files, created on first use
+    int pipe[2];
 };
 
 /*
@@ -21,7 +21,7 @@ struct tcp_server {
     struct event_main *event_main;
 };
 
-int tcp_listen (int *sockp, const char *host, const char *port, int backlog)
+int tcp_listen (int *sockp, const char *host, const char *port, int backlog, int flags)
 {
     int err;
     struct addrinfo hints = {
@@ -49,6 +49,24 @@ int tcp_listen (int *sockp, const char *host, const char *port, int backlog)
         }
 
         log_info("%s...", sockaddr_str(addr->ai_addr, addr->ai_addrlen));
+
+        if (flags & TCP_LISTEN_REUSEPORT) {
+#ifdef SO_REUSEPORT
+            int optval = 1;
+
+            if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval))) {
+                log_pwarning("setsockopt SO_REUSEPORT");
+                close(sock);
+                sock = -1;
+                continue;
+            }
+#else
+            log_warning("SO_REUSEPORT is not supported");
+            close(sock);
+            sock = -1;
+            continue;
+#endif
+        }
         
         // bind to listen address/port
         if ((err = bind(sock, addr->ai_addr, addr->ai_addrlen)) < 0) {
@@ -83,7 +101,7 @@ int tcp_listen (int *sockp, const char *host, const char *port, int backlog)
     return 0;
 }
 
-int tcp_server (struct event_main *event_main, struct tcp_server **serverp, const char *host, const char *port)
+int tcp_server (struct event_main *event_main, struct tcp_server **serverp, const char *host, const char *port, int flags)
 {
     struct tcp_server *server;
     int err;
@@ -95,7 +113,7 @@ int tcp_server (struct event_main *event_main, struct tcp_server **serverp, cons
 
     server->event_main = event_main;
     
-    if ((err = tcp_listen(&server->sock, host, port, TCP_LISTEN_BACKLOG))) {
+    if ((err = tcp_listen(&server->sock, host, port, TCP_LISTEN_BACKLOG, flags))) {
         log_perror("tcp_listen %s:%s", host, port);
         goto error;
     }
@@ -119,12 +137,48 @@ error:
     return err;
 }
 
+/*
+ * Accept a new connection using event_io().
+ *
+ * Returns 0 on success, 1 if the connection was aborted before it could be accepted, <0 on error, with errno left
+ * as EMFILE/ENFILE if out of files.
+ */
+static int tcp_server_accept_io (struct tcp_server *server, int *sockp)
+{
+    int err;
+
+    if ((err = event_io(server->event, EVENT_IO_ACCEPT, NULL, 0, NULL, sockp)) < 0 && (errno == ECONNABORTED || errno == EINTR)) {
+        log_pwarning("event_io accept: retrying");
+        return 1;
+
+    } else if (err < 0 && (errno == EMFILE || errno == ENFILE)) {
+        return -1;
+
+    } else if (err) {
+        log_perror("event_io accept");
+
+        // not a temporary failure
+        errno = 0;
+
+        return -1;
+    }
+
+    return 0;
+}
+
 int tcp_server_accept (struct tcp_server *server, struct tcp **tcpp)
 {
     int err;
     int sock;
 
-    while ((err = sock_accept(server->sock, &sock)) != 0) {
+    while (true) {
+        // drain any pending connections without waiting, before waiting on the backend for the next one
+        if ((err = sock_accept(server->sock, &sock)) > 0 && event_io_supported(server->event))
+            err = tcp_server_accept_io(server, &sock);
+
+        if (!err)
+            break;
+
         // handle various error cases
         if (err < 0 && (errno == EMFILE || errno == ENFILE)) {
             log_pwarning("temporary accept failure: retrying");
@@ -66,7 +66,7 @@ int udp_connect (struct event_main *event_main, struct udp **udpp, const char *h
     struct addrinfo *addrs, *addr;
     int sock = -1;
 
-    if ((err = getaddrinfo(host, port, &hints, &addrs))) {
+    if ((err = sock_resolve(event_main, &addrs, host, port, &hints))) {
         log_perror("getaddrinfo %s:%s: %s", host, port, gai_strerror(err));
         return -1;
     }
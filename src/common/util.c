@@ -6,10 +6,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 const char *strdump (const char *str)
 {
-    static char buf[STRDUMP_MAX];
+    static __thread char buf[STRDUMP_MAX];
 
     const char *c = str;
     char *outc = buf;
@@ -98,48 +99,46 @@ const char * str_fmt (char *buf, size_t len, const char *fmt, ...)
 
 int timestamp_now (struct timeval *timestamp)
 {
-    if (gettimeofday(timestamp, NULL)) {
-        log_perror("gettimeofday");
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+        log_perror("clock_gettime");
         return -1;
     }
- 
+
+    timestamp->tv_sec = now.tv_sec;
+    timestamp->tv_usec = now.tv_nsec / 1000;
+
     return 0;
 }
 
 int timestamp_from_timeout (struct timeval *timestamp, const struct timeval *timeout)
 {
-    if (gettimeofday(timestamp, NULL)) {
-        log_perror("gettimeofday");
+    struct timeval now;
+
+    if (timestamp_now(&now))
         return -1;
-    }
     
-    // set timeout in future
-    // XXX: tv_usec overflow?
-    timestamp->tv_sec += timeout->tv_sec;
-    timestamp->tv_usec += timeout->tv_usec;
+    // set timeout in future, normalizing tv_usec
+    timeradd(&now, timeout, timestamp);
 
     return 0;
 }
 
 int timeout_from_timestamp (struct timeval *timeout, const struct timeval *timestamp)
 {
-    if (gettimeofday(timeout, NULL)) {
-        log_pwarning("gettimeofday");
+    struct timeval now;
+
+    if (timestamp_now(&now))
         return -1;
-    }
     
-    if (timestamp->tv_sec >= timeout->tv_sec && timestamp->tv_usec >= timeout->tv_usec) {
-        timeout->tv_sec = timestamp->tv_sec - timeout->tv_sec;
-        timeout->tv_usec = timestamp->tv_usec - timeout->tv_usec;
-
-    } else if (timestamp->tv_sec > timeout->tv_sec && timestamp->tv_usec < timeout->tv_usec) {
-        timeout->tv_sec = timestamp->tv_sec - timeout->tv_sec - 1;
-        timeout->tv_usec = 1000000 + timestamp->tv_usec - timeout->tv_usec;
+    if (timercmp(timestamp, &now, >=)) {
+        timersub(timestamp, &now, timeout);
 
     } else {
-        log_info("timestamp in past: %ld:%ld < %ld:%ld",
-                timeout->tv_sec, timeout->tv_usec,
-                timestamp->tv_sec, timestamp->tv_usec
+        log_debug("timestamp in past: %ld:%ld < %ld:%ld",
+                timestamp->tv_sec, timestamp->tv_usec,
+                now.tv_sec, now.tv_usec
         );
         timeout->tv_sec = 0;
         timeout->tv_usec = 0;
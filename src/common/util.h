@@ -31,7 +31,9 @@ int str_uint (const char *str, unsigned *uintp);
 const char * str_fmt (char *buf, size_t len, const char *fmt, ...);
 
 /*
- * Set given timestamp to the present.
+ * Set given timestamp to the present, using CLOCK_MONOTONIC.
+ *
+ * These timestamps are unaffected by changes to the wall-clock time, and are only meaningful relative to each other.
  */
 int timestamp_now (struct timeval *timestamp);
 
@@ -63,7 +63,7 @@ const char * dns_type_str (enum dns_type type)
     } else if (dns_type_strs[type]) {
         return dns_type_strs[type];
     } else {
-        static char buf[32];
+        static __thread char buf[32];
 
         return str_fmt(buf, sizeof(buf), "%d", type);
     }
@@ -107,6 +107,8 @@ int dns_create (struct event_main *event_main, struct dns **dnsp, const char *re
         return -1;
     }
 
+    dns->event_main = event_main;
+
     TAILQ_INIT(&dns->resolves);
 
     if ((err = udp_connect(event_main, &dns->udp, resolver, DNS_SERVICE))) {
@@ -5,6 +5,7 @@
 
 #include "common/udp.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <sys/queue.h>
 
@@ -12,8 +13,12 @@
  * DNS resolver state for multiple dns_reolve's.
  */
 struct dns {
+    struct event_main *event_main;
     struct udp *udp;
 
+    // some task is reading responses for all resolves
+    bool reading;
+
     // query id pool
     uint16_t ids;
 
@@ -16,8 +16,8 @@ struct dns_resolve {
     // debugging purposes
     const char *name;
 
-    // used for event_wait() on response...
-    struct event_task *wait;
+    // used for waiting on a response read by some other task, created on demand
+    struct event_queue *queue;
 
     // used for both query and response
     struct dns_packet packet;
@@ -52,6 +52,21 @@ struct dns_resolve {
 
 static const struct timeval dns_resolve_timeout = { 2, 0 }; // 2s
 static const int DNS_RESOLVE_RETRY = 5; // 10s
+static const struct timeval dns_resolve_wait_timeout = { 12, 0 }; // retries + 2s
+
+/*
+ * Set the resolve timeout for a sent query, using the cached event_main time if available.
+ */
+static int dns_resolve_timestamp (struct dns_resolve *resolve)
+{
+    if (resolve->dns->event_main) {
+        event_main_timestamp(resolve->dns->event_main, &resolve->timeout, &dns_resolve_timeout);
+
+        return 0;
+    }
+
+    return timestamp_from_timeout(&resolve->timeout, &dns_resolve_timeout);
+}
 
 int dns_resolve_create (struct dns *dns, struct dns_resolve **resolvep)
 {
@@ -132,8 +147,8 @@ int dns_resolve_query (struct dns_resolve *resolve)
     }
 
     // set timeout
-    if (timestamp_from_timeout(&resolve->timeout, &dns_resolve_timeout)) {
-        log_error("timestamp_now");
+    if (dns_resolve_timestamp(resolve)) {
+        log_error("dns_resolve_timestamp");
         goto error;
     }
 
@@ -162,8 +177,8 @@ int dns_resolve_retry (struct dns_resolve *resolve)
     }
 
     // set new timeout
-    if (timestamp_from_timeout(&resolve->timeout, &dns_resolve_timeout)) {
-        log_error("timestamp_now");
+    if (dns_resolve_timestamp(resolve)) {
+        log_error("dns_resolve_timestamp");
         goto error;
     }
 
@@ -223,7 +238,13 @@ int dns_resolve_response (struct dns *dns, struct dns_resolve **resolvep)
     struct dns_resolve *resolve = TAILQ_FIRST(&dns->resolves);
     struct timeval timeout;
 
-    if ((err = timeout_from_timestamp(&timeout, &resolve->timeout)) < 0) {
+    if (dns->event_main) {
+        err = event_main_timeout(dns->event_main, &timeout, &resolve->timeout);
+    } else {
+        err = timeout_from_timestamp(&timeout, &resolve->timeout);
+    }
+
+    if (err < 0) {
         log_error("timeout_from_timestamp");
         return -1;
 
@@ -293,6 +314,36 @@ int dns_resolve_response (struct dns *dns, struct dns_resolve **resolvep)
     return 0;
 }
 
+/*
+ * Wake up the task waiting for a response to the given resolve, if any.
+ *
+ * Returns 1 if woken, 0 if not waiting.
+ */
+static int dns_resolve_wake (struct dns_resolve *resolve)
+{
+    if (!resolve->queue)
+        return 0;
+
+    return event_queue_wake(resolve->queue);
+}
+
+/*
+ * Hand over reading responses to the first task still waiting for a response, if any.
+ */
+static void dns_resolve_handover (struct dns *dns)
+{
+    struct dns_resolve *resolve;
+
+    TAILQ_FOREACH(resolve, &dns->resolves, dns_resolves) {
+        if (dns_resolve_wake(resolve)) {
+            log_debug("%s[%u] takes over", resolve->name, resolve->id);
+            return;
+        }
+    }
+
+    log_debug("no waiting resolves");
+}
+
 /*
  * Synchronize pending resolves, multiplexing tasks across the dns state.
  *
@@ -300,118 +351,82 @@ int dns_resolve_response (struct dns *dns, struct dns_resolve **resolvep)
  */
 int dns_resolve_sync (struct dns_resolve *resolve)
 {
-    struct event *event = dns_event(resolve->dns);
+    struct dns *dns = resolve->dns;
     struct dns_resolve *next;
+    bool reader = false;
     int err;
 
     /*
-     * This uses very scary event_wait/notify() magic amongst all tasks waiting on this one event, which leads to
-     * all kinds of interesting (as in "May you live in interesting times") behaviour.
-     *
-     * event_wait() is based on the use of the event_switch() stack, i.e. tasks call into eachother in a linear
-     * hierarchy. event_main() will event_switch() into a task, which may event_start() another task, or event_notify()
-     * into another task, and so on. Once a task calls event_yield(), or event_wait(), it will rewind the task stack,
-     * eventually ending up back in event_main().
-     *
-     * However, this falls apart completely if a set of tasks uses event_notify() to freely switch
-     * between eachother, i.e. causing a loop in the task stack. Task A that has notify()'d task B may not itself be
-     * notify()'d by B (or C).
-     *
-     * Happily, though, once task A calls event_notify(B), it will still be sitting within event_notify() at the point
-     * where B might want to event_notify(A), and thus as long as we ensure that A->wait is not set when it calls
-     * event_notify(), we should be reasonably safe...
-     *
-     * The other issue, though, is that a task that is yield()'ing on an event has a strict responsibility to notify()
-     * any other tasks wait()'ing on that event - if it doesn't, those tasks will all die. Thus:
-     *
-     *  *   if we recv() a response for a different task that has previously wait()'ing, we will notify() it, and it will
-     *      eventually return back, whereupon our response may have been recv()'d by some notify()'d task, or we will
-     *      yield() if the notify()'d tasks have all finished, or we will wait() for the next main() iteration if some
-     *      notify()'d task has yield()'d.
-     *
-     *  *   if we recv() a response to our own resolv and we return it, our task might either perform another resolv(),
-     *      whereupon we will again yield() on the event, and any tasks that notify()'d us will wait(). If our response
-     *      was the final resolv for our task, and it goes off to do something else, then other tasks will be able to
-     *      continue if they have notify()'d us. However, if we were event_yield()'ing directly from main(), then we
-     *      must be careful to keep any other tasks that have wait()'d on us in some previous event_main() iteration
-     *      alive by giving them a "fake" notify() to get them to yield() instead.
+     * Only one task at a time reads responses from the shared socket, handing them over to the resolves of any other
+     * tasks, which wait on their own resolve's queue meanwhile. Once the reading task has its own response, it wakes
+     * up the next waiting task to take over reading.
      */
     while (!resolve->response) {
-        if (!event || !event_pending(event)) {
-            // there is no task yielding on the event already, so we are free to go ahead and yield on it.
-            if (event) {
-                log_debug("%s[%u] recv/yield on event[%p]...", resolve->name, resolve->id, event);
-            } else {
-                log_debug("%s[%u] recv without event...", resolve->name, resolve->id);
+        if (dns->reading) {
+            // wait for the reading task to recv our response, or hand over reading to us
+            if (!resolve->queue && event_queue_create(dns->event_main, &resolve->queue)) {
+                log_error("event_queue_create");
+                return -1;
             }
 
-            // recv()/yield() a response
-            if ((err = dns_resolve_response(resolve->dns, &next)) < 0) {
-                log_error("%s[%u] dns_resolve_response", resolve->name, resolve->id);
+            log_debug("%s[%u] waiting for response...", resolve->name, resolve->id);
+
+            if ((err = event_queue_wait(resolve->queue, &dns_resolve_wait_timeout)) < 0) {
+                log_error("event_queue_wait");
                 return -1;
 
             } else if (err) {
-                log_debug("%s[%u] retry..", resolve->name, resolve->id);
-                continue;
-            }
+                log_warning("%s[%u] timeout waiting for response", resolve->name, resolve->id);
 
-            // the response that we get may not necessarily be our own
-            if (next == resolve) {
-                log_debug("%s[%u] immediate response", resolve->name, resolve->id);
-                break;
-            }
+                // give up on our query, any later response will be unmatched
+                if (!resolve->response) {
+                    TAILQ_REMOVE(&dns->resolves, resolve, dns_resolves);
+                    resolve->response = -1;
+                }
 
-            if (!event) {
-                // XXX: just buffer the resolv somewhere... currently dns_resolve_response() dequeues it, though..
-                log_fatal("dns_resolve_sync called with multiple pending queries in non-task mode; unable to operate");
-                return -1;
+                break;
             }
 
-            // dispatch and redo
-            if (!next->wait) {
-                log_debug("%s[%u] response for non-waiting resolv %s[%u], assuming it has notify()'d us", resolve->name, resolve->id, next->name, next->id);
-                continue;
-            }
+            continue;
+        }
 
-            log_debug("%s[%u] dispatching response to %s[%u]", resolve->name, resolve->id, next->name, next->id);
-            if ((err = event_notify(event, &next->wait))) {
-                log_error("event_notify");
-                continue;
-            }
+        log_debug("%s[%u] reading...", resolve->name, resolve->id);
 
-        } else {
-            // wait for some other task to recv our response...
-            log_debug("%s[%u] waiting on event[%p] for response...", resolve->name, resolve->id, event);
+        // recv()/yield() a response
+        dns->reading = reader = true;
+        err = dns_resolve_response(dns, &next);
+        dns->reading = false;
 
-            // TODO: timeout support, in case the task servicing the event somehow e.g. dies with `return -1`?
-            if (event_wait(event, &resolve->wait)) {
-                log_error("event_wait");
-                return -1;
-            }
+        if (err < 0) {
+            log_error("%s[%u] dns_resolve_response", resolve->name, resolve->id);
+            dns_resolve_handover(dns);
+            return -1;
 
-            if (resolve->response)
-                log_debug("%s[%u] got response from wait()", resolve->name, resolve->id);
-            else
-                log_debug("%s[%u] got notify()'d without a response, assuming some yield()'ing task is asking us to yield()", resolve->name, resolve->id);
+        } else if (err) {
+            log_debug("%s[%u] retry..", resolve->name, resolve->id);
+            continue;
         }
-    }
 
-    // in case we were yielding on an event, and other tasks waited on it, and we got our final response and never yield
-    // on it again, we must poke another waiting task at this point in order to keep the queue alive.
-    next = TAILQ_FIRST(&resolve->dns->resolves);
+        // the response that we get may not necessarily be our own
+        if (next == resolve) {
+            log_debug("%s[%u] response", resolve->name, resolve->id);
+            break;
+        }
 
-    if (!next) {
-        log_debug("no resolves left");
-    } else if (!next->wait) {
-        log_debug("%s[%u] is not waiting, we assume they have notify()'d us previously", next->name, next->id);
-    } else {
-        // go ahead and notify them...
-        log_debug("%s[%u] is poking %s[%u] to keep resolvers alive", resolve->name, resolve->id, next->name, next->id);
-        if ((err = event_notify(event, &next->wait))) {
-            log_error("event_notify");
+        if (!dns->event_main) {
+            // XXX: just buffer the resolv somewhere... currently dns_resolve_response() dequeues it, though..
+            log_fatal("dns_resolve_sync called with multiple pending queries in non-task mode; unable to operate");
+            return -1;
         }
+
+        log_debug("%s[%u] dispatching response to %s[%u]", resolve->name, resolve->id, next->name, next->id);
+
+        dns_resolve_wake(next);
     }
 
+    if (reader)
+        dns_resolve_handover(dns);
+
     if (resolve->response < 0) {
         log_debug("%s[%u] timeout", resolve->name, resolve->id);
 
@@ -463,7 +478,7 @@ int dns_resolve (struct dns *dns, struct dns_resolve **resolvep, const char *nam
     return resolve->response_header.rcode;
 
 err:
-    free(resolve);
+    dns_close(resolve);
 
     return err;
 }
@@ -501,7 +516,7 @@ int dns_resolve_multi (struct dns *dns, struct dns_resolve **resolvep, const cha
     return resolve->response_header.rcode;
 
 err:
-    free(resolve);
+    dns_close(resolve);
 
     return err;
 }
@@ -598,5 +613,8 @@ void dns_close (struct dns_resolve *resolve)
         TAILQ_REMOVE(&resolve->dns->resolves, resolve, dns_resolves);
     }
 
+    if (resolve->queue)
+        event_queue_destroy(resolve->queue);
+
     free(resolve);
 }
@@ -269,7 +269,7 @@ const char * dns_rdata_str (struct dns_record *rr, union dns_rdata *rdata)
 {
     // INET_ADDRSTRLEN < INET6_ADDRSTRLEN < 1KB
     // DNS_NAME < 1KB
-    static char buf[1024];
+    static __thread char buf[1024];
 
     switch (rr->type) {
         case DNS_A:
@@ -1,6 +1,7 @@
 #include "server/server.h"
 #include "server/static.h"
 #include "server/dns.h"
+#include "server/stats.h"
 
 #include "common/daemon.h"
 #include "common/event.h"
@@ -9,8 +10,11 @@
 #include "common/util.h"
 
 #include <getopt.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/resource.h>
 #include <unistd.h>
 
@@ -18,17 +22,34 @@ struct options {
     FILE *log_file;
     bool daemon;
     unsigned nfiles;
+    unsigned stack_size;
+    unsigned buffer_size;
+    unsigned threads;
+    unsigned slow_task;
     const char *iam;
     const char *S;
     const char *U;
     bool dns;
+    bool stats;
     const char *resolver;
 
     /* Processed */
+    struct event_main **event_mains;
+    pthread_t *event_threads;
     struct server *server;
     struct server_static *server_static;
     struct server_static *server_upload;
     struct server_dns *server_dns;
+    struct server_stats *server_stats;
+};
+
+enum opts {
+    OPT_START       = 255,
+    OPT_STACK_SIZE,
+    OPT_THREADS,
+    OPT_STATS,
+    OPT_SLOW_TASK,
+    OPT_BUFFER_SIZE,
 };
 
 static const struct option main_options[] = {
@@ -40,11 +61,16 @@ static const struct option main_options[] = {
 
     { "daemon",        0,    NULL,        'D'    },
     { "nfiles",     1,  NULL,       'N' },
+    { "stack-size", 1,  NULL,       OPT_STACK_SIZE  },
+    { "threads",    1,  NULL,       OPT_THREADS     },
+    { "slow-task",  1,  NULL,       OPT_SLOW_TASK   },
+    { "buffer-size", 1, NULL,       OPT_BUFFER_SIZE },
 
     { "iam",        1,    NULL,        'I' },
     { "static",        1,    NULL,        'S' },
     { "upload",     1,  NULL,       'U' },
     { "dns",        0,  NULL,       'P' },
+    { "stats",      0,  NULL,       OPT_STATS       },
 
     { "resolver",   1,  NULL,       'R' },
 
@@ -63,11 +89,16 @@ void help (const char *argv0) {
             "\n"
             "   -D --daemon         Daemonize\n"
             "   -N --nfiles         Limit number of open files\n"
+            "      --stack-size     Stack size in bytes for each client task\n"
+            "      --threads        Run given number of event loops in separate threads\n"
+            "      --slow-task      Log tasks running for more than the given microseconds without yielding\n"
+            "      --buffer-size    Maximum read buffer size in bytes for each client connection\n"
             "\n"
             "   -I --iam=username   Send Iam header\n"
             "   -S --static=path    Serve static files from /\n"
             "   -U --upload=path    Accept PUT files to /upload\n"
             "   -P --dns            Serve POST requests to /dns-query\n"
+            "      --stats          Serve event loop stats at /stats\n"
             "\n"
             "   -R --resolver       DNS resolver address\n"
             "\n"
@@ -91,16 +122,17 @@ int init_nfiles (struct options *options, struct event_main *event_main)
         }
     }
 
-    if (!max || nofile.rlim_cur < max) {
+    if (max && nofile.rlim_cur >= max) {
+        log_warning("currently set --nfiles rlimit %lu is too high, adjusting to %d - 1", nofile.rlim_cur, max);
+
+        // safe limit...
+        nofile.rlim_cur = nofile.rlim_max = max - 1;
+
+    } else if (!options->nfiles) {
         log_info("using --nfiles limit %lu < %d", nofile.rlim_cur, max);
         return 0;
     }
 
-    log_warning("currently set --nfiles rlimit %lu is too high, adjusting to %d - 1", nofile.rlim_cur, max);
-
-    // safe limit...
-    nofile.rlim_cur = nofile.rlim_max = max - 1;
-
     if (setrlimit(RLIMIT_NOFILE, &nofile)) {
         log_perror("setrlimit: nofile: %lu/%lu", nofile.rlim_cur, nofile.rlim_max);
         return -1;
@@ -121,21 +153,94 @@ int main_listen (struct options *options, const char *arg)
 
     log_info("%s: host=%s port=%s path=%s iam=%s", arg, urlbuf.url.host, urlbuf.url.port, urlbuf.url.path, options->iam);
 
-    if ((err = server_listen(options->server, urlbuf.url.host, urlbuf.url.port))) {
-        log_fatal("server_listen %s %s", urlbuf.url.host, urlbuf.url.port);
-        return err;
+    if (!options->event_mains) {
+        if ((err = server_listen(options->server, urlbuf.url.host, urlbuf.url.port))) {
+            log_fatal("server_listen %s %s", urlbuf.url.host, urlbuf.url.port);
+            return err;
+        }
+
+        return 0;
+    }
+
+    for (unsigned i = 0; i < options->threads; i++) {
+        if ((err = server_listen_shared(options->server, options->event_mains[i], urlbuf.url.host, urlbuf.url.port))) {
+            log_fatal("server_listen_shared %s %s", urlbuf.url.host, urlbuf.url.port);
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Create an event_main for each --threads, the first being the given event_main for the main thread.
+ */
+int init_threads (struct options *options, struct event_main *event_main)
+{
+    if (!(options->event_mains = calloc(options->threads, sizeof(*options->event_mains)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    if (!(options->event_threads = calloc(options->threads, sizeof(*options->event_threads)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    options->event_mains[0] = event_main;
+
+    for (unsigned i = 1; i < options->threads; i++) {
+        if (event_main_create(&options->event_mains[i])) {
+            log_error("event_main_create");
+            return -1;
+        }
+
+        if (options->stack_size && event_main_set_stack_size(options->event_mains[i], options->stack_size)) {
+            log_error("event_main_set_stack_size");
+            return -1;
+        }
+
+        event_main_set_slow_task(options->event_mains[i], options->slow_task);
+
+        if (options->buffer_size && event_main_set_buf_size(options->event_mains[i], options->buffer_size)) {
+            log_error("event_main_set_buf_size");
+            return -1;
+        }
     }
 
     return 0;
 }
 
+/*
+ * Run one of the --threads event_main's.
+ */
+void *main_thread (void *ctx)
+{
+    struct event_main *event_main = ctx;
+
+    if (event_thread_init()) {
+        log_fatal("event_thread_init");
+        return NULL;
+    }
+
+    if (event_main_run(event_main)) {
+        log_fatal("event_main_run");
+    }
+
+    event_thread_cleanup();
+
+    return NULL;
+}
+
 int main (int argc, char **argv)
 {
     int opt, longopt;
     enum log_level log_level = LOG_WARNING;
+    unsigned threads = 0;
     int err = 0;
     struct options options = {
         .iam        = getlogin(),
+        .slow_task  = EVENT_TASK_SLOW,
     };
     struct event_main *event_main;
 
@@ -175,6 +280,34 @@ int main (int argc, char **argv)
                 }
                 break;
 
+            case OPT_STACK_SIZE:
+                if (str_uint(optarg, &options.stack_size)) {
+                    log_fatal("invalid --stack-size: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_SLOW_TASK:
+                if (str_uint(optarg, &options.slow_task)) {
+                    log_fatal("invalid --slow-task: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_BUFFER_SIZE:
+                if (str_uint(optarg, &options.buffer_size)) {
+                    log_fatal("invalid --buffer-size: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_THREADS:
+                if (str_uint(optarg, &options.threads)) {
+                    log_fatal("invalid --threads: %s", optarg);
+                    return 1;
+                }
+                break;
+
             case 'I':
                 options.iam = optarg;
                 break;
@@ -191,6 +324,10 @@ int main (int argc, char **argv)
                 options.dns = true;
                 break;
 
+            case OPT_STATS:
+                options.stats = true;
+                break;
+
             case 'R':
                 options.resolver = optarg;
                 break;
@@ -211,11 +348,28 @@ int main (int argc, char **argv)
         goto error;
     }
 
+    if (options.stack_size && (err = event_main_set_stack_size(event_main, options.stack_size))) {
+        log_fatal("invalid --stack-size for event mainloop");
+        goto error;
+    }
+
+    event_main_set_slow_task(event_main, options.slow_task);
+
+    if (options.buffer_size && (err = event_main_set_buf_size(event_main, options.buffer_size))) {
+        log_fatal("invalid --buffer-size for event mainloop");
+        goto error;
+    }
+
     if ((err = init_nfiles(&options, event_main))) {
         log_fatal("invalid --nfiles setting for event mainloop");
         goto error;
     }
 
+    if (options.threads > 1 && (err = init_threads(&options, event_main))) {
+        log_fatal("invalid --threads setting");
+        goto error;
+    }
+
     // apply
     if ((err = server_create(event_main, &options.server))) {
         log_fatal("server_create");
@@ -239,6 +393,13 @@ int main (int argc, char **argv)
         }
     }
 
+    if (options.stats) {
+        if ((err = server_stats_create(&options.server_stats, options.server, "stats"))) {
+            log_fatal("server_stats_create");
+            goto error;
+        }
+    }
+
     if (options.S) {
         if ((err = server_static_create(&options.server_static, options.S, options.server, "", SERVER_STATIC_GET))) {
             log_fatal("server_static_add: %s", "/");
@@ -270,12 +431,31 @@ int main (int argc, char **argv)
         log_set_file(options.log_file);
     }
 
+    for (unsigned i = 1; options.event_mains && i < options.threads; i++) {
+        if ((err = pthread_create(&options.event_threads[i], NULL, main_thread, options.event_mains[i]))) {
+            log_fatal("pthread_create: %s", strerror(err));
+            goto error;
+        }
+
+        threads++;
+    }
+
     if ((err = event_main_run(event_main))) {
         log_fatal("event_main_run");
         goto error;
     }
 
+    for (; threads; threads--) {
+        pthread_join(options.event_threads[threads], NULL);
+    }
+
 error:
+    if (threads) {
+        // the event_mains already running in other threads cannot be stopped, and still use the server
+        log_fatal("exit with %u event_main threads still running", threads);
+        return 1;
+    }
+
     if (options.server)
         server_destroy(options.server);
 
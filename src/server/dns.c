@@ -3,16 +3,95 @@
 #include "common/log.h"
 #include "../dns.h" // XXX: terrible naming failure
 
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/queue.h>
+
+/*
+ * Resolver for each event_main that requests are handled on.
+ */
+struct server_dns_main {
+    struct event_main *event_main;
+    struct dns *dns;
+
+    TAILQ_ENTRY(server_dns_main) server_dns_mains;
+};
 
 struct server_dns {
     /* Embed */
     struct server_handler handler;
 
-    /* Shared across requests */
-    struct dns *dns;
+    const char *resolver;
+
+    /* Shared across requests on the same event_main */
+    pthread_mutex_t mutex;
+    TAILQ_HEAD(server_dns_mains, server_dns_main) mains;
 };
 
+/*
+ * Find the shared dns for the given event_main, with the mutex held.
+ */
+static struct server_dns_main * server_dns_find (struct server_dns *s, struct event_main *event_main)
+{
+    struct server_dns_main *dns_main;
+
+    TAILQ_FOREACH(dns_main, &s->mains, server_dns_mains) {
+        if (dns_main->event_main == event_main)
+            return dns_main;
+    }
+
+    return NULL;
+}
+
+/*
+ * Return the shared dns for use on the given event_main, creating it on first use.
+ */
+static int server_dns_get (struct server_dns *s, struct event_main *event_main, struct dns **dnsp)
+{
+    struct server_dns_main *dns_main, *found;
+
+    pthread_mutex_lock(&s->mutex);
+    dns_main = server_dns_find(s, event_main);
+    pthread_mutex_unlock(&s->mutex);
+
+    if (dns_main) {
+        *dnsp = dns_main->dns;
+        return 0;
+    }
+
+    if (!(dns_main = calloc(1, sizeof(*dns_main)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    dns_main->event_main = event_main;
+
+    if (dns_create(event_main, &dns_main->dns, s->resolver)) {
+        log_error("dns_create: %s", s->resolver);
+        free(dns_main);
+        return -1;
+    }
+
+    // dns_create() may yield to another client on this event_main, which may have created one in the meantime
+    pthread_mutex_lock(&s->mutex);
+
+    if (!(found = server_dns_find(s, event_main)))
+        TAILQ_INSERT_TAIL(&s->mains, dns_main, server_dns_mains);
+
+    pthread_mutex_unlock(&s->mutex);
+
+    if (found) {
+        dns_destroy(dns_main->dns);
+        free(dns_main);
+        dns_main = found;
+    }
+
+    *dnsp = dns_main->dns;
+
+    return 0;
+}
+
 int server_dns_lookup (struct dns *dns, struct server_client *client, const char *name, const char *type)
 {
     int err;
@@ -111,21 +190,10 @@ int server_dns_request (struct server_handler *handler, struct server_client *cl
     const char *name = NULL, *type = NULL, *server = NULL;
     int err;
 
-    // read request
-    const char *header, *value;
     log_debug("%s", url->query);
 
-    while (!(err = server_request_header(client, &header, &value))) {
-
-    }
-
-    if (err != 1) {
-        log_error("server_request_header: %d", err);
-        return err;
-    }
-
     // parse GET/POST parameters
-    const char *key;
+    const char *key, *value;
 
     while (!(err = server_request_param(client, &key, &value))) {
         if (!strcasecmp(key, "name")) {
@@ -148,19 +216,24 @@ int server_dns_request (struct server_handler *handler, struct server_client *cl
     }
 
     // resolver
-    struct dns *dns = NULL;
+    struct event_main *event_main = server_client_event_main(client);
+    struct dns *dns = NULL, *shared_dns;
 
     if (server) {
         // new dns for given resolver (server)
-        // XXX: this invokes a blocking resolver lookup for the given server
-        if ((err = dns_create(s->handler.event_main, &dns, server))) {
+        // the resolver lookup for the given server is offloaded by udp_connect()
+        if ((err = dns_create(event_main, &dns, server))) {
             log_error("dns_create: %s", server);
             return 400;
         }
+
+    } else if ((err = server_dns_get(s, event_main, &shared_dns))) {
+        log_error("server_dns_get");
+        return err;
     }
 
     // handle
-    err = server_dns_lookup(dns ? dns : s->dns, client, name, type);
+    err = server_dns_lookup(dns ? dns : shared_dns, client, name, type);
 
     if (dns)
         dns_destroy(dns);
@@ -178,6 +251,10 @@ int server_dns_create (struct server_dns **sp, struct server *server, const char
     }
 
     s->handler.request = server_dns_request;
+    s->resolver = resolver;
+
+    pthread_mutex_init(&s->mutex, NULL);
+    TAILQ_INIT(&s->mains);
 
     log_info("GET %s", path);
 
@@ -191,8 +268,11 @@ int server_dns_create (struct server_dns **sp, struct server *server, const char
         goto error;
     }
 
-    if (dns_create(s->handler.event_main, &s->dns, resolver)) {
-        log_error("dns_create: %s", resolver);
+    // check resolver for the server's own event_main up front
+    struct dns *dns;
+
+    if (server_dns_get(s, s->handler.event_main, &dns)) {
+        log_error("server_dns_get: %s", resolver);
         goto error;
     }
 
@@ -206,6 +286,14 @@ error:
 
 void server_dns_destroy (struct server_dns *s)
 {
-    dns_destroy(s->dns);
+    struct server_dns_main *dns_main;
+
+    while ((dns_main = TAILQ_FIRST(&s->mains))) {
+        TAILQ_REMOVE(&s->mains, dns_main, server_dns_mains);
+        dns_destroy(dns_main->dns);
+        free(dns_main);
+    }
+
+    pthread_mutex_destroy(&s->mutex);
     free(s);
 }
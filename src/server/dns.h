@@ -8,7 +8,7 @@ struct server_dns;
 /*
  * Initialize and mount onto the given server path.
  *
- * resolver:    passed to dns_create(), may be NULL.
+ * resolver:    passed to dns_create() for each event_main, may be NULL. Must remain valid for the lifetime of the server.
  */
 int server_dns_create (struct server_dns **sp, struct server *server, const char *path, const char *resolver);
 
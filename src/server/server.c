@@ -7,6 +7,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/queue.h>
@@ -18,15 +19,16 @@ struct server {
     /* Listen tasks */
     TAILQ_HEAD(server_listens, server_listen) listens;
 
-    /* Handler lookup */
+    /* Handler lookup; immutable once listening, and shared by all event_main's */
     TAILQ_HEAD(server_handlers, server_handler_item) handlers;
 
-    /* Response headers */
+    /* Response headers; immutable once listening, and shared by all event_main's */
     TAILQ_HEAD(server_headers, server_header) headers;
 };
 
 struct server_listen {
     struct server *server;
+    struct event_main *event_main;
     struct tcp_server *tcp;
 
     TAILQ_ENTRY(server_listen) server_listens;
@@ -50,6 +52,7 @@ struct server_header {
 
 struct server_client {
     struct server *server;
+    struct event_main *event_main;
     struct tcp *tcp;
     struct http *http;
 
@@ -64,12 +67,18 @@ struct server_client {
         /* Storage for request Host header */
         char hostbuf[HTTP_HOST_MAX];
 
+        /* Request line and headers, pointing into the read buffer until the request body is read */
+        struct http_head head;
+
         /* Decoded request URL, including query */
         struct url url;
 
         /* Size of request entity, or zero */
         size_t content_length;
 
+        /* Request entity uses chunked transfer encoding */
+        bool chunked;
+
         /* Does the client support HTTP/1.1? */
         bool http11;
 
@@ -78,10 +87,11 @@ struct server_client {
 
         /* Progress */
         bool request;
-        bool header;
-        bool headers;
         bool body;
 
+        /* Next header for server_request_header() */
+        unsigned header;
+
         /* XXX: Decoding GET params in-place from url.query */
         char *get_query;
 
@@ -266,7 +276,134 @@ error:
 }
 
 /*
- * Read the client request line.
+ * Process the well-known request headers.
+ *
+ * Returns 0 on success, http 4xx on client error.
+ */
+static int server_request_headers (struct server_client *client)
+{
+    const struct http_head *head = &client->request.head;
+    const char *value;
+
+    for (unsigned i = 0; i < head->count; i++) {
+        const struct http_header *header = &head->headers[i];
+        const struct http_header *first = head->known[header->id];
+
+        log_info("\t%20s : %s", header->name, header->value);
+
+        // repeated framing headers could be interpreted differently by some intermediary
+        if (header->id == HTTP_HEADER_CONTENT_LENGTH && header != first && strcmp(header->value, first->value)) {
+            log_warning("conflicting content-length: %s", header->value);
+            return 400;
+        }
+
+        if (header->id == HTTP_HEADER_TRANSFER_ENCODING && header != first) {
+            log_warning("repeated transfer-encoding: %s", header->value);
+            return 400;
+        }
+    }
+
+    if ((value = http_head_get(head, HTTP_HEADER_CONTENT_LENGTH))) {
+        size_t content_length = 0;
+        const char *c;
+
+        for (c = value; *c >= '0' && *c <= '9'; c++) {
+            if (content_length > (SIZE_MAX - (*c - '0')) / 10) {
+                log_warning("content_length is too large: %s", value);
+                return 413;
+            }
+
+            content_length = content_length * 10 + (*c - '0');
+        }
+
+        if (c == value || (*c && *c != ' ' && *c != '\t')) {
+            log_warning("invalid content_length: %s", value);
+            return 400;
+        }
+
+        log_debug("content_length=%zu", content_length);
+
+        client->request.content_length = content_length;
+    }
+
+    if ((value = http_head_get(head, HTTP_HEADER_TRANSFER_ENCODING))) {
+        if (strcasecmp(value, "chunked") != 0) {
+            log_warning("unknown transfer-encoding: %s", value);
+            return 501;
+        }
+
+        if (http_head_get(head, HTTP_HEADER_CONTENT_LENGTH)) {
+            log_warning("both transfer-encoding and content-length given");
+            return 400;
+        }
+
+        log_debug("request content is chunked");
+
+        client->request.chunked = true;
+    }
+
+    if ((value = http_head_get(head, HTTP_HEADER_HOST))) {
+        if (strlen(value) >= sizeof(client->request.hostbuf)) {
+            log_warning("host is too long: %zu", strlen(value));
+            return 400;
+        }
+
+        // copied, as the head is not valid once the request body has been read
+        strcpy(client->request.hostbuf, value);
+
+        // TODO: parse :port?
+        client->request.url.host = client->request.hostbuf;
+    }
+
+    if ((value = http_head_get(head, HTTP_HEADER_CONNECTION))) {
+        if (strcasecmp(value, "close") == 0) {
+            log_debug("using connection-close");
+
+            client->response.close = true;
+
+        } else if (strcasecmp(value, "keep-alive") == 0) {
+            /* Used by some HTTP/1.1 clients, apparently to request persistent connections.. */
+            log_debug("explicitly not using connection-close");
+
+            client->response.close = false;
+
+        } else {
+            log_warning("unknown connection header: %s", value);
+        }
+    }
+
+    if ((value = http_head_get(head, HTTP_HEADER_CONTENT_TYPE))) {
+        if (strcasecmp(value, "application/x-www-form-urlencoded") == 0) {
+            log_debug("request content is form data");
+
+            client->request.content_form = true;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Process the request version, determining the response version.
+ */
+static void server_request_version (struct server_client *client, const char *version)
+{
+    if (strcasecmp(version, "HTTP/1.0") == 0) {
+        client->request.http11 = false;
+
+        // implicit Connection: close
+        client->response.close = true;
+
+    } else if (strcasecmp(version, "HTTP/1.1") == 0) {
+        client->request.http11 = true;
+
+    } else {
+        log_warning("unknown request version: %s", version);
+    }
+}
+
+/*
+ * Read the client request line and headers.
  *
  * Returns 0 on success, <0 on internal error, 1 on EOF, http 4xx on client error.
  */
@@ -280,8 +417,17 @@ int server_request (struct server_client *client)
         return -1;
     }
 
-    if ((err = http_read_request(client->http, &method, &path, &version)))
+    if ((err = http_read_request_head(client->http, &client->request.head))) {
+        // respond to invalid headers using the request version
+        if (err > 1 && client->request.head.version)
+            server_request_version(client, client->request.head.version);
+
         return err;
+    }
+
+    method = client->request.head.method;
+    path = client->request.head.path;
+    version = client->request.head.version;
 
     if (strlen(method) >= sizeof(client->request.method)) {
         log_warning("method is too long: %zu", strlen(method));
@@ -313,18 +459,7 @@ int server_request (struct server_client *client)
     
     log_info("%s %s %s", method, path, version);
 
-    if (strcasecmp(version, "HTTP/1.0") == 0) {
-        client->request.http11 = false;
-
-        // implicit Connection: close
-        client->response.close = true;
-
-    } else if (strcasecmp(version, "HTTP/1.1") == 0) {
-        client->request.http11 = true;
-
-    } else {
-        log_warning("unknown request version: %s", version);
-    }
+    server_request_version(client, version);
 
     if (strcasecmp(method, "GET") == 0) {
         // XXX: decoded in-place, stripping const
@@ -333,6 +468,9 @@ int server_request (struct server_client *client)
         client->request.post = true;
     }
 
+    if ((err = server_request_headers(client)))
+        return err;
+
     return 0;
 }
 
@@ -345,88 +483,59 @@ int server_request_query (struct server_client *client, const char **keyp, const
 
 int server_request_header (struct server_client *client, const char **namep, const char **valuep)
 {
-    int err;
+    const struct http_head *head = &client->request.head;
 
     if (!client->request.request) {
         log_fatal("premature read of request headers before request line");
         return -1;
     }
 
-    if (client->request.headers) {
-        log_warning("request headers have already been read");
-        
-        // ignore..
-        return 1;
-    }
-
-    if ((err = http_read_header(client->http, namep, valuep)) < 0) {
-        log_warning("http_read_header");
-        return err;
+    if (client->request.body) {
+        log_warning("request headers are no longer valid after reading the request body");
+        return -1;
     }
 
-    if (err == 1) {
-        log_debug("end of headers");
-        client->request.headers = true;
+    if (client->request.header >= head->count)
         return 1;
-    } else if (err) {
-        log_warning("http_read_header: %d", err);
-        return err;
-    }
 
-    // mark as having read some headers
-    client->request.header = true;
+    *namep = head->headers[client->request.header].name;
+    *valuep = head->headers[client->request.header].value;
 
-    log_info("\t%20s : %s", *namep, *valuep);
-
-    if (strcasecmp(*namep, "Content-Length") == 0) {
-        if (sscanf(*valuep, "%zu", &client->request.content_length) != 1) {
-            log_warning("invalid content_length: %s", *valuep);
-            return 400;
-        }
-
-        log_debug("content_length=%zu", client->request.content_length);
-
-    } else if (strcasecmp(*namep, "Host") == 0) {
-        if (strlen(*valuep) >= sizeof(client->request.hostbuf)) {
-            log_warning("host is too long: %zu", strlen(*valuep));
-            return 400;
-        } else {
-            strncpy(client->request.hostbuf, *valuep, sizeof(client->request.hostbuf));
-        }
-        
-        // TODO: parse :port?
-        client->request.url.host = client->request.hostbuf;
-
-    } else if (strcasecmp(*namep, "Connection") == 0) {
-        if (strcasecmp(*valuep, "close") == 0) {
-            log_debug("using connection-close");
+    client->request.header++;
 
-            client->response.close = true;
-
-        } else if (strcasecmp(*valuep, "keep-alive") == 0) {
-            /* Used by some HTTP/1.1 clients, apparently to request persistent connections.. */
-            log_debug("explicitly not using connection-close");
+    return 0;
+}
 
-            client->response.close = false;
+const char * server_request_lookup (struct server_client *client, enum http_header_id id)
+{
+    if (client->request.body) {
+        log_warning("request headers are no longer valid after reading the request body");
+        return NULL;
+    }
 
-        } else {
-            log_warning("unknown connection header: %s", *valuep);
-        }
+    return http_head_get(&client->request.head, id);
+}
 
-    } else if (strcasecmp(*namep, "Content-Type") == 0) {
-        if (strcasecmp(*valuep, "application/x-www-form-urlencoded") == 0) {
-            log_debug("request content is form data");
+/*
+ * Write out any buffered responses to earlier pipelined requests, before reading a request body that has not been
+ * received yet, such that they are neither held back while waiting, nor lost if reading the body fails.
+ */
+static int server_request_flush (struct server_client *client)
+{
+    if (!client->request.chunked && client->request.content_length <= http_read_buffered(client->http))
+        return 0;
 
-            client->request.content_form = true;
-        }
+    if (http_flush(client->http)) {
+        log_warning("http_flush");
+        return -1;
     }
-    
+
     return 0;
 }
 
 int server_request_form (struct server_client *client, const char **keyp, const char **valuep)
 {
-    if (!client->request.headers) {
+    if (!client->request.request) {
         log_fatal("reading request form data before headers?");
         return -1;
     }
@@ -443,6 +552,9 @@ int server_request_form (struct server_client *client, const char **keyp, const
         return 411;
     
     } else {
+        if (server_request_flush(client))
+            return -1;
+
         // read in request body; either exactly content_length or to EOF
         if (http_read_string(client->http, &client->request.post_form, client->request.content_length)) {
             log_warning("http_read_string");
@@ -481,7 +593,7 @@ int server_request_file (struct server_client *client, int fd)
 {
     int err;
 
-    if (!client->request.headers) {
+    if (!client->request.request) {
         log_fatal("read request body without reading headers!?");
         return -1;
     }
@@ -493,15 +605,31 @@ int server_request_file (struct server_client *client, int fd)
         return -1;
     }
 
-    // TODO: Transfer-Encoding?
-    if (!client->request.content_length) {
+    if (server_request_flush(client))
+        return -1;
+
+    if (client->request.chunked) {
+        err = http_read_chunked_file(client->http, fd);
+
+    } else if (!client->request.content_length) {
         log_debug("no request body given");
         return 411;
+
+    } else {
+        err = http_read_file(client->http, fd, client->request.content_length);
     }
-        
-    if (((err = http_read_file(client->http, fd, client->request.content_length)))){
-        log_warning("http_read_file");
+
+    if (err < 0) {
+        log_warning("failed to read request body");
         return err;
+
+    } else if (err) {
+        log_warning("incomplete or invalid request body: %d", err);
+
+        // the rest of the request body may still follow
+        client->response.close = true;
+
+        return 400;
     }
 
     client->request.body = true;
@@ -749,6 +877,9 @@ int server_client_request (struct server *server, struct server_client *client)
         return 1;
 
     } else if (err) {
+        // the request body framing is unknown
+        client->response.close = true;
+
         goto error;
     } 
 
@@ -765,24 +896,12 @@ int server_client_request (struct server *server, struct server_client *client)
         }
     }
 
-    // headers?
-    if (!client->request.headers) {
-        const char *header, *value;
-
-        log_debug("reading remaining headers...");
-
-        // read remaining headers, in case they contain anything relevant for the error response
-        // don't clobber err!
-        while (!server_request_header(client, &header, &value)) {
-
-        }
-    }
-
     // body?
     // TODO: needs better logic for when a request contains a body?
-    if (!client->request.body && client->request.content_length) {
+    if (!client->request.body && (client->request.chunked || client->request.content_length > http_read_buffered(client->http))) {
         // force close, as pipelining will fail
         // we don't want to wait for the entire request body to upload before failing the request...
+        // an already received body is discarded after the response instead
         log_debug("ignoring client request body");
 
         client->response.close = true;
@@ -839,6 +958,30 @@ error:
         }
     }
 
+    // skip over any already received unread request body, to keep the connection usable for the next request
+    bool discard = !client->request.body && client->request.content_length && !client->response.close;
+
+    if (discard) {
+        log_debug("discarding client request body: %zu", client->request.content_length);
+
+        if (http_read_file(client->http, -1, client->request.content_length)) {
+            log_warning("failed to discard request body");
+
+            client->response.close = true;
+        }
+
+        client->request.body = true;
+    }
+
+    // write out the buffered response, unless there is a pipelined request to respond to along with it
+    if (!client->response.close && !discard && http_read_pending(client->http)) {
+        log_debug("pipelining response");
+
+    } else if (http_flush(client->http)) {
+        log_warning("failed to flush response");
+        return -1;
+    }
+
     // persistent connection?
     if (client->response.close) {
         return 1;
@@ -864,6 +1007,9 @@ void server_client_task (void *ctx)
 
     // handle multiple requests
     while (true) {
+        // no buffers needed while waiting for the next request
+        tcp_release(client->tcp);
+
         // reset request/response state...
         client->request = (struct server_request) { };
         client->response = (struct server_response) { };
@@ -889,7 +1035,12 @@ error:
     free(client);
 }
 
-int server_client (struct server *server, struct tcp *tcp)
+struct event_main *server_client_event_main (struct server_client *client)
+{
+    return client->event_main;
+}
+
+int server_client (struct server_listen *listen, struct tcp *tcp)
 {
     struct server_client *client;
     int err = 0;
@@ -899,7 +1050,8 @@ int server_client (struct server *server, struct tcp *tcp)
         goto error;
     }
 
-    client->server = server;
+    client->server = listen->server;
+    client->event_main = listen->event_main;
     client->tcp = tcp;
 
     if ((err = http_create(&client->http, tcp_read_stream(tcp), tcp_write_stream(tcp)))) {
@@ -907,8 +1059,9 @@ int server_client (struct server *server, struct tcp *tcp)
         goto error;
     }
 
-    if ((err = event_start(server->event_main, server_client_task, client))) {
-        log_perror("event_start");
+    // started once the listener has drained its accept backlog
+    if ((err = event_spawn(listen->event_main, server_client_task, client))) {
+        log_perror("event_spawn");
         goto error;
     }
 
@@ -940,7 +1093,7 @@ void server_listen_task (void *ctx)
             break;
         }
         
-        if ((err = server_client(listen->server, tcp))) {
+        if ((err = server_client(listen, tcp))) {
             log_warning("server_client");
         }
     }
@@ -949,7 +1102,7 @@ void server_listen_task (void *ctx)
     free(listen);
 }
 
-int server_listen (struct server *server, const char *host, const char *port)
+static int _server_listen (struct server *server, struct event_main *event_main, const char *host, const char *port, int flags)
 {
     struct server_listen *listen;
 
@@ -959,13 +1112,14 @@ int server_listen (struct server *server, const char *host, const char *port)
     }
 
     listen->server = server;
+    listen->event_main = event_main;
 
-    if (tcp_server(server->event_main, &listen->tcp, host, port)) {
+    if (tcp_server(event_main, &listen->tcp, host, port, flags)) {
         log_warning("tcp_server");
         goto error;
     }
 
-    if (event_start(server->event_main, server_listen_task, listen)) {
+    if (event_start(event_main, server_listen_task, listen)) {
         log_warning("event_start");
         goto error;
     }
@@ -981,6 +1135,16 @@ error:
     return -1;
 }
 
+int server_listen (struct server *server, const char *host, const char *port)
+{
+    return _server_listen(server, server->event_main, host, port, 0);
+}
+
+int server_listen_shared (struct server *server, struct event_main *event_main, const char *host, const char *port)
+{
+    return _server_listen(server, event_main, host, port, TCP_LISTEN_REUSEPORT);
+}
+
 void server_destroy (struct server *server)
 {
     // TODO: listens
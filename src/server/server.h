@@ -15,9 +15,12 @@ struct server_client;
 
 /*
  * Request handler.
+ *
+ * With multiple event_main's, the request() may be called concurrently from different threads, and should use
+ * server_client_event_main() for any per-request events.
  */
 struct server_handler {
-    /* Server state, set by server_add_handler */
+    /* Server state, set by server_add_handler; this is the server's own event_main */
     struct event_main *event_main;
 
     /* Handler implementation */
@@ -34,6 +37,16 @@ int server_create (struct event_main *event_main, struct server **serverp);
  */
 int server_listen (struct server *server, const char *host, const char *port);
 
+/*
+ * Listen on given host/port, running the listener and its clients on the given event_main.
+ *
+ * The listen socket is bound using SO_REUSEPORT, so that multiple event_main's running in separate threads may each
+ * listen on the same host/port, and the kernel will distribute new connections between them.
+ *
+ * All handlers and headers must be added before listening.
+ */
+int server_listen_shared (struct server *server, struct event_main *event_main, const char *host, const char *port);
+
 /*
  * Add a server handler for requests.
  *
@@ -56,6 +69,11 @@ int server_add_handler (struct server *server, const char *method, const char *p
  */
 int server_add_header (struct server *server, const char *name, const char *value);
 
+/*
+ * Return the event_main that the client is running on.
+ */
+struct event_main *server_client_event_main (struct server_client *client);
+
 /*
  * Read request URL query param.
  *
@@ -64,12 +82,21 @@ int server_add_header (struct server *server, const char *name, const char *valu
 int server_request_query (struct server_client *client, const char **keyp, const char **valuep);
 
 /*
- * Read request header.
+ * Iterate over the request headers, which have already been read along with the request line.
+ *
+ * The returned name and value are only valid until the request body is read.
  *
  * Returns 1 on end-of-headers.
  */
 int server_request_header (struct server_client *client, const char **name, const char **value);
 
+/*
+ * Return the value of the first well-known request header with the given id, or NULL if not present.
+ *
+ * The returned value is only valid until the request body is read.
+ */
+const char * server_request_lookup (struct server_client *client, enum http_header_id id);
+
 /*
  * Read request body form param.
  *
@@ -13,6 +13,11 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+/*
+ * Number of directory entries to list before letting other tasks run.
+ */
+#define SERVER_STATIC_DIR_YIELD 256
+
 struct server_static {
     /* Embed */
     struct server_handler handler;
@@ -112,6 +117,7 @@ static int server_static_dir_item (struct server_client *client, const char *pat
 int server_static_dir (struct server_static *s, struct server_client *client, DIR *dir, const struct url *url)
 {
     struct dirent *d;
+    unsigned count = 0;
     int err;
 
     // ensure dir path ends in /
@@ -166,6 +172,12 @@ int server_static_dir (struct server_static *s, struct server_client *client, DI
         
         if ((err = server_static_dir_item(client, d->d_name, isdir, glyphicon, title)))
             break;
+
+        // huge directories would otherwise stall all other clients
+        if (++count % SERVER_STATIC_DIR_YIELD == 0 && (err = event_yield_now(server_client_event_main(client)))) {
+            log_error("event_yield_now");
+            break;
+        }
     }
     
     err |= server_response_print(client, 
@@ -377,6 +389,25 @@ error:
     return ret;
 }
 
+struct server_static_lookup {
+    struct server_static *ss;
+    const char *path;
+    int create;
+
+    int fd;
+    struct stat *statp;
+    const struct server_static_mimetype *mime;
+
+    int ret;
+};
+
+static void server_static_lookup_offload (void *ctx)
+{
+    struct server_static_lookup *lookup = ctx;
+
+    lookup->ret = server_static_lookup(lookup->ss, lookup->path, lookup->create, &lookup->fd, lookup->statp, &lookup->mime);
+}
+
 /*
  * Request handler.
  */
@@ -390,16 +421,6 @@ int server_static_request (struct server_handler *handler, struct server_client
     int ret = 0;
     int create;
 
-    // see if there are any interesting request headers
-    const char *header, *value;
-
-    while (!(ret = server_request_header(client, &header, &value))) {
-
-    }
-
-    if (ret < 0)
-        goto error;
-
     // lookup
     if (strcasecmp(method, "GET") == 0 && (ss->flags & SERVER_STATIC_GET)) {
         create = 0;
@@ -412,10 +433,26 @@ int server_static_request (struct server_handler *handler, struct server_client
         return 400;
     }
 
-    if ((ret = server_static_lookup(ss, url->path, create, &fd, &stat, &mime))) {
+    // the filesystem may block on stat/open
+    struct server_static_lookup lookup = {
+        .ss     = ss,
+        .path   = url->path,
+        .create = create,
+        .statp  = &stat,
+    };
+
+    if (event_offload(server_client_event_main(client), server_static_lookup_offload, &lookup)) {
+        log_error("event_offload");
+        return 500;
+    }
+
+    if ((ret = lookup.ret)) {
         return ret;
     }
 
+    fd = lookup.fd;
+    mime = lookup.mime;
+
     log_info("%s %s %s %s", ss->root, method, url->path, mime ? mime->content_type : "(unknown mimetype)");
     
     // check
@@ -0,0 +1,189 @@
+#include "server/stats.h"
+
+#include "common/log.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct server_stats {
+    /* Embed */
+    struct server_handler handler;
+};
+
+/*
+ * Size of the buffer used to send the response in larger chunks, rather than one per line.
+ */
+#define SERVER_STATS_BUF 4096
+
+struct server_stats_buf {
+    struct server_client *client;
+
+    char buf[SERVER_STATS_BUF];
+    size_t len;
+};
+
+/*
+ * Send out any buffered output as part of the response.
+ */
+static int server_stats_flush (struct server_stats_buf *b)
+{
+    int err;
+
+    if (!b->len)
+        return 0;
+
+    if ((err = server_response_print(b->client, "%.*s", (int) b->len, b->buf)))
+        return err;
+
+    b->len = 0;
+
+    return 0;
+}
+
+/*
+ * Append formatted output to the buffer, flushing it first if full.
+ */
+static int server_stats_print (struct server_stats_buf *b, const char *fmt, ...)
+    __attribute((format (printf, 2, 3)));
+
+static int server_stats_print (struct server_stats_buf *b, const char *fmt, ...)
+{
+    va_list args;
+    int ret, err;
+
+    for (;;) {
+        va_start(args, fmt);
+        ret = vsnprintf(b->buf + b->len, sizeof(b->buf) - b->len, fmt, args);
+        va_end(args);
+
+        if (ret < 0) {
+            log_perror("vsnprintf");
+            return -1;
+        } else if (b->len + ret < sizeof(b->buf)) {
+            b->len += ret;
+            return 0;
+        } else if (!b->len) {
+            log_warning("truncated: %s -> %d", fmt, ret);
+            return -1;
+        }
+
+        if ((err = server_stats_flush(b)))
+            return err;
+    }
+}
+
+/*
+ * Output a histogram summary, followed by each non-empty bucket with its upper bound.
+ */
+static int server_stats_histogram (struct server_stats_buf *b, const char *name, const struct event_histogram *histogram)
+{
+    int err;
+
+    if ((err = server_stats_print(b, "%-24s count=%lu sum=%lu max=%lu\n", name, histogram->count, histogram->sum, histogram->max)))
+        return err;
+
+    for (unsigned i = 0; i < EVENT_HISTOGRAM_BUCKETS; i++) {
+        if (!histogram->buckets[i])
+            continue;
+
+        if (i == EVENT_HISTOGRAM_BUCKETS - 1)
+            err = server_stats_print(b, "%-24s  >=%-10lu %lu\n", name, 1UL << (i - 1), histogram->buckets[i]);
+        else
+            err = server_stats_print(b, "%-24s  <%-11lu %lu\n", name, 1UL << i, histogram->buckets[i]);
+
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
+int server_stats_request (struct server_handler *handler, struct server_client *client, const char *method, const struct url *url)
+{
+    struct server_stats_buf b = { .client = client };
+    struct event_stats stats;
+    int err;
+
+    event_main_stats(server_client_event_main(client), &stats);
+
+    if ((err = server_response(client, 200, NULL)))
+        return err;
+
+    if ((err = server_response_header(client, "Content-Type", "text/plain")))
+        return err;
+
+    err |= server_stats_print(&b,
+            "%-24s %lu\n"
+            "%-24s %lu\n"
+            "%-24s %u\n"
+            "%-24s %zu\n"
+            "%-24s %u\n"
+            "%-24s %zu\n"
+            "%-24s %u\n"
+            "%-24s %u\n"
+            "%-24s %u\n",
+            "iterations", stats.iterations,
+            "switches", stats.switches,
+            "tasks", stats.tasks,
+            "stack_bytes", stats.stack_bytes,
+            "stacks_pooled", stats.stacks_pooled,
+            "buf_bytes_pooled", stats.buf_bytes_pooled,
+            "spawning", stats.spawning,
+            "pending", stats.pending,
+            "timers", stats.timers
+    );
+
+    err |= server_stats_histogram(&b, "iteration_time_us", &stats.iteration_time);
+    err |= server_stats_histogram(&b, "wait_time_us", &stats.wait_time);
+    err |= server_stats_histogram(&b, "wait_ready", &stats.wait_ready);
+    err |= server_stats_histogram(&b, "timer_lag_us", &stats.timer_lag);
+
+    err |= server_stats_print(&b, "%-24s %lu\n", "slow_slices", stats.slow_slices);
+
+    if (err)
+        return err;
+
+    // per task
+    const struct event_task_stats *task_stats = NULL;
+
+    while ((task_stats = event_main_task_stats(server_client_event_main(client), task_stats))) {
+        if ((err = server_stats_print(&b, "task %-19s tasks=%lu slices=%lu time_us=%lu max_us=%lu slow=%lu\n", task_stats->name,
+                task_stats->tasks, task_stats->slices, task_stats->time, task_stats->max, task_stats->slow
+        )))
+            return err;
+    }
+
+    return server_stats_flush(&b);
+}
+
+int server_stats_create (struct server_stats **sp, struct server *server, const char *path)
+{
+    struct server_stats *s;
+
+    if (!(s = calloc(1, sizeof(*s)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    s->handler.request = server_stats_request;
+
+    log_info("GET %s", path);
+
+    if (server_add_handler(server, "GET", path, &s->handler)) {
+        log_error("server_add_handler: GET");
+        goto error;
+    }
+
+    *sp = s;
+    return 0;
+
+error:
+    free(s);
+    return -1;
+}
+
+void server_stats_destroy (struct server_stats *s)
+{
+    free(s);
+}
@@ -0,0 +1,22 @@
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#include "server/server.h"
+
+struct server_stats;
+
+/*
+ * Initialize and mount onto the given server path.
+ *
+ * Serves the event_main_stats() for the event_main that the request is handled on, as text/plain.
+ */
+int server_stats_create (struct server_stats **sp, struct server *server, const char *path);
+
+/*
+ * Release all associated resources.
+ *
+ * Only do this after the handler has been unregistered, i.e. server_destroy()!
+ */
+void server_stats_destroy (struct server_stats *s);
+
+#endif
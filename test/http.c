@@ -1,7 +1,11 @@
+#include "test.h"
+
 #include "common/http.h"
 #include "common/http_test.h"
 #include "common/log.h"
+#include "common/util.h"
 
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -37,7 +41,156 @@ int test_header (const char *str)
         log_error("[ERROR] '%s'", str);
     }
 
-    log_info("[OK] '%s': header='%s' value='%s'", str, header, value);
+    log_info("[OK] '%s': header='%s' value='%s' id=%d", str, header, value, http_header_lookup(header, strlen(header)));
+
+    return 0;
+}
+
+struct test_head {
+    const char *str;
+    int err;
+    const char *path;
+    unsigned count;
+    const char *host, *value;
+} head_tests[] = {
+    { "GET /foo HTTP/1.1\r\nHost: foo\r\n\r\n",                 0,      "/foo", 1, "foo"     },
+    { "GET /foo HTTP/1.1\nHost: foo\n\n",                          0,      "/foo", 1, "foo"     },
+    { "GET / HTTP/1.1\r\nX-Foo: a\r\n b\r\n\tc\r\nHost: foo\r\n\r\n", 0, "/", 2, "foo", "a   b  \tc" },
+    { "GET / HTTP/1.1\r\nhost: foo\r\nHost: bar\r\n\r\n",        0,      "/",    2, "foo"     },
+    { "GET / HTTP/1.1\r\n\r\n",                                   0,      "/",    0, NULL      },
+    { "GET / HTTP/1.1\r\n b\r\n\r\n",                             400                         },
+    { "GET / HTTP/1.1\r\nHost: foo\r\n",                          400                         },
+    { "GET / HTTP/1.1\r\nHost\r\n\r\n",                           400                         },
+    { "GET / HTTP/1.1\r\nHost x: foo\r\n\r\n",                    400                         },
+    { "GET / HTTP/1.1\r\nHost : foo\r\n\r\n",                     400                         },
+    { "PUT / HTTP/1.1\r\nTransfer-Encoding x: chunked\r\n\r\n",   400                         },
+    { "\r\n",                                                     400                         },
+    { }
+};
+
+int test_head (const struct test_head *test)
+{
+    char buf[1024];
+    struct http_head head;
+    size_t size = strlen(test->str);
+    int err;
+
+    memcpy(buf, test->str, size);
+
+    if ((err = http_parse_head(buf, size, &head)) != test->err) {
+        log_warning("[fail] %s: err %d != %d", strdump(test->str), err, test->err);
+        return 1;
+    }
+
+    if (err)
+        return 0;
+
+    if (head.count != test->count) {
+        log_warning("[fail] %s: count %u != %u", strdump(test->str), head.count, test->count);
+        return 1;
+    }
+
+    err |= test_string("path", test->path, head.path);
+    err |= test_string("host", test->host, http_head_get(&head, HTTP_HEADER_HOST));
+
+    if (test->value)
+        err |= test_string("value", test->value, head.headers[0].value);
+
+    return err;
+}
+
+int test_head_max (void)
+{
+    char buf[HTTP_HEADERS_MAX * 16 + 64], *c = buf;
+    struct http_head head;
+    int err;
+
+    c += sprintf(c, "GET / HTTP/1.1\r\n");
+
+    for (int i = 0; i <= HTTP_HEADERS_MAX; i++)
+        c += sprintf(c, "X-%d: y\r\n", i);
+
+    c += sprintf(c, "\r\n");
+
+    if ((err = http_parse_head(buf, c - buf, &head)) != 431) {
+        log_warning("[fail] %d headers: err %d != 431", HTTP_HEADERS_MAX + 1, err);
+        return 1;
+    }
+
+    // the request line is still available for the error response
+    return test_string("version", "HTTP/1.1", head.version);
+}
+
+struct test_lookup {
+    const char *name;
+    enum http_header_id id;
+} lookup_tests[] = {
+    { "Host",               HTTP_HEADER_HOST                },
+    { "Content-Length",     HTTP_HEADER_CONTENT_LENGTH      },
+    { "Connection",         HTTP_HEADER_CONNECTION          },
+    { "Content-Type",       HTTP_HEADER_CONTENT_TYPE        },
+    { "Transfer-Encoding",  HTTP_HEADER_TRANSFER_ENCODING   },
+    { "If-None-Match",      HTTP_HEADER_IF_NONE_MATCH       },
+    { "Range",              HTTP_HEADER_RANGE               },
+    { "content-length",     HTTP_HEADER_CONTENT_LENGTH      },
+    { "RANGE",              HTTP_HEADER_RANGE               },
+    { "X-Host",             HTTP_HEADER_OTHER               },
+    { "Hosts",              HTTP_HEADER_OTHER               },
+    { "Content-Lengths",    HTTP_HEADER_OTHER               },
+    { "Connectiom",         HTTP_HEADER_OTHER               },
+    { "",                   HTTP_HEADER_OTHER               },
+    { }
+};
+
+int test_lookup (const struct test_lookup *test)
+{
+    enum http_header_id id = http_header_lookup(test->name, strlen(test->name));
+
+    if (id != test->id) {
+        log_warning("[fail] %s: id %d != %d", test->name, id, test->id);
+        return 1;
+    }
+
+    return 0;
+}
+
+struct test_chunk {
+    const char *line;
+    int err;
+    size_t size;
+} chunk_tests[] = {
+    { "0",                  0,      0                   },
+    { "5",                  0,      5                   },
+    { "1aF",                0,      0x1af               },
+    { "10;foo=bar",         0,      16                  },
+    { "ffffffffffffffff",   0,      SIZE_MAX            },
+    { "",                   400                         },
+    { ";foo",               400                         },
+    { "-0",                 400                         },
+    { "-1",                 400                         },
+    { "+5",                 400                         },
+    { "0x5",                400                         },
+    { " 5",                 400                         },
+    { "5 ",                 400                         },
+    { "5g",                 400                         },
+    { "10000000000000000",  400                         },
+    { }
+};
+
+int test_chunk (const struct test_chunk *test)
+{
+    size_t size = 0;
+    int err;
+
+    if ((err = http_parse_chunk_size(test->line, &size)) != test->err) {
+        log_warning("[fail] %s: err %d != %d", test->line, err, test->err);
+        return 1;
+    }
+
+    if (!err && size != test->size) {
+        log_warning("[fail] %s: size %zu != %zu", test->line, size, test->size);
+        return 1;
+    }
 
     return 0;
 }
@@ -52,6 +205,22 @@ int main (int argc, char **argv)
     // skip argv0
     argv++;
 
+    for (const struct test_head *test = head_tests; test->str; test++)
+        err |= test_head(test);
+
+    err |= test_head_max();
+
+    for (const struct test_lookup *test = lookup_tests; test->name; test++)
+        err |= test_lookup(test);
+
+    for (const struct test_chunk *test = chunk_tests; test->line; test++)
+        err |= test_chunk(test);
+
+    if (err)
+        log_error("[FAIL] http_parse_head");
+    else
+        log_info("[OK] http_parse_head");
+
     // first arg is response line
     err |= test_response(*argv++);
 
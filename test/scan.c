@@ -0,0 +1,138 @@
+/*
+ * Include the implementation directly, to test each of the vectorized variants against the scalar loop, regardless of
+ * which one scan_mem()/scan_str() would select on this cpu.
+ */
+#include "common/scan.c"
+
+#include "common/log.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * Reference for scan_str(), as scan_str_scalar() is only built without SCAN_X86.
+ */
+static char * test_scan_str_scalar (const char *p, char a, char b, char c)
+{
+    for (; *p; p++) {
+        if (*p == a || *p == b || *p == c)
+            break;
+    }
+
+    return (char *) p;
+}
+
+struct test_scan {
+    const char *name;
+    char * (*scan_mem)(const char *buf, const char *end, char a, char b);
+    char * (*scan_str)(const char *str, char a, char b, char c);
+    bool avx2;
+} scan_tests[] = {
+#ifdef SCAN_X86
+    { "sse2",       scan_mem_sse2,      scan_str_sse2 },
+    { "avx2",       scan_mem_avx2,      scan_str_avx2,      .avx2 = true },
+#else
+    { "scalar",     scan_mem_scalar,    scan_str_scalar },
+#endif
+    { "dispatch",   scan_mem,           scan_str },
+    { }
+};
+
+/*
+ * Delimiters are placed at every other byte outside of the scanned data, such that any bytes left unmasked or scanned
+ * past either end would be noticed, and never mistaken for the end itself.
+ */
+#define TEST_SCAN_OFFSETS 32
+#define TEST_SCAN_LENGTH 96
+
+static char test_buf[TEST_SCAN_OFFSETS + TEST_SCAN_LENGTH + 64] __attribute__((aligned(64)));
+
+static void test_fill (size_t offset, size_t len)
+{
+    for (size_t i = 0; i < sizeof(test_buf); i++)
+        test_buf[i] = (i - offset - len) % 2 ? '\n' : 'y';
+
+    memset(test_buf + offset, 'x', len);
+}
+
+int test_scan_mem (const struct test_scan *test, size_t offset, size_t len, size_t pos)
+{
+    const char *buf = test_buf + offset, *end = buf + len;
+
+    test_fill(offset, len);
+
+    if (pos < len)
+        test_buf[offset + pos] = '\r';
+
+    const char *expected = scan_mem_scalar(buf, end, '\r', '\n');
+    const char *value = test->scan_mem(buf, end, '\r', '\n');
+
+    if (value != expected) {
+        log_warning("[fail] scan_mem_%s offset=%zu len=%zu pos=%zu: %td != %td", test->name, offset, len, pos, value - buf, expected - buf);
+        return 1;
+    }
+
+    return 0;
+}
+
+int test_scan_str (const struct test_scan *test, size_t offset, size_t len, size_t pos)
+{
+    const char *str = test_buf + offset;
+
+    test_fill(offset, len);
+
+    test_buf[offset + len] = '\0';
+
+    if (pos < len)
+        test_buf[offset + pos] = ':';
+
+    const char *expected = test_scan_str_scalar(str, ':', ' ', '\n');
+    const char *value = test->scan_str(str, ':', ' ', '\n');
+
+    if (value != expected) {
+        log_warning("[fail] scan_str_%s offset=%zu len=%zu pos=%zu: %td != %td", test->name, offset, len, pos, value - str, expected - str);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main (int argc, char **argv)
+{
+    int err = 0;
+
+    log_set_level(LOG_INFO);
+
+    for (const struct test_scan *test = scan_tests; test->name; test++) {
+        int fail = 0;
+
+        if (test->avx2 && !__builtin_cpu_supports("avx2")) {
+            log_info("[skip] %s", test->name);
+            continue;
+        }
+
+        // every start offset within an aligned block, with the delimiter or NUL at every position
+        for (size_t offset = 0; offset < TEST_SCAN_OFFSETS; offset++) {
+            for (size_t len = 0; len < TEST_SCAN_LENGTH; len++) {
+                for (size_t pos = 0; pos <= len; pos++) {
+                    fail |= test_scan_mem(test, offset, len, pos);
+                    fail |= test_scan_str(test, offset, len, pos);
+                }
+            }
+        }
+
+        if (fail)
+            log_warning("[fail] %s", test->name);
+        else
+            log_info("[ok] %s", test->name);
+
+        err |= fail;
+    }
+
+    if (err)
+        log_error("[FAIL] scan");
+    else
+        log_info("[OK] scan");
+
+    return err;
+}